@@ -0,0 +1,519 @@
+/* benchmark driver for the tree operations
+ *
+ * measures throughput (ns/op) and latency percentiles of insert_node,
+ * build_tree, search, search_batch, search_frozen, delete_node, range_search
+ * and in-order iteration for a
+ * grid of tree sizes, key distributions and node allocators, plus cache
+ * misses per op through perf_event_open when the kernel allows it.
+ *
+ * distributions describe the order (and for zipf the skew) of the keys fed
+ * to an operation, the key set itself is always 1..n:
+ * 	seq  - ascending
+ * 	rev  - descending
+ * 	rand - a random permutation
+ * 	zipf - zipfian draws (theta 0.99) over randomly placed hot keys, so
+ * 		   inserts and deletes see duplicates and lookups see hot spots
+ *
+ * allocators describe where the nodes of the tree under test live:
+ * 	malloc - one create_node per key, inserted in distribution order
+ * 	block  - a single build_tree block, nodes in preorder
+ * 	veb    - the malloc tree copied by compact_tree, van emde boas order
+ * other malloc implementations are compared by running with LD_PRELOAD.
+ * insert is only measured with malloc and build only with block.
+ *
+ * latency is measured on one op out of RB_BENCH_SAMPLE_EVERY so the clock
+ * reads do not skew the throughput numbers, the cost of a clock read is
+ * subtracted from every sample. build is one call and has no percentiles.
+ * batch looks keys up RB_BENCH_BATCH at a time, its ns/op is per key and its
+ * percentiles are per batch. frozen searches a freeze_tree snapshot of the
+ * tree, taken before the clock starts.
+ *
+ * --shape=FILE writes the tree_shape of every tree left by the insert runs
+ * to FILE, one json object per line. --trace=FILE writes the events of an
+ * RB_TRACE build after the last run, see rb_trace_dump.
+ *
+ * usage: rb_bench [--sizes=1e3,1e4,...] [--dists=seq,rev,rand,zipf]
+ * 		  [--ops=insert,build,search,batch,frozen,delete,range,iter]
+ * 		  [--allocs=malloc,block,veb] [--seed=N] [--json] [--shape=FILE]
+ * 		  [--trace=FILE]
+ */
+#include "bench_util.h"
+#include "rbtree.h"
+#include "rbtree_frozen.h"
+#include "rbtree_trace.h"
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define RB_BENCH_SAMPLE_EVERY 32
+#define RB_BENCH_RANGE_LEN	  64
+#define RB_BENCH_BATCH		  32
+#define RB_BENCH_ZIPF_THETA	  0.99
+
+typedef enum {
+	DIST_SEQ,
+	DIST_REV,
+	DIST_RAND,
+	DIST_ZIPF,
+	DIST_COUNT
+} dist_t;
+
+typedef enum {
+	OP_INSERT,
+	OP_BUILD,
+	OP_SEARCH,
+	OP_BATCH,
+	OP_FROZEN,
+	OP_DELETE,
+	OP_RANGE,
+	OP_ITER,
+	OP_COUNT
+} op_t;
+
+typedef enum {
+	ALLOC_MALLOC,
+	ALLOC_BLOCK,
+	ALLOC_VEB,
+	ALLOC_COUNT
+} alloc_t;
+
+static const char *dist_names[DIST_COUNT]	= {"seq", "rev", "rand", "zipf"};
+static const char *op_names[OP_COUNT]		= {"insert", "build", "search", "batch",
+											   "frozen", "delete", "range",  "iter"};
+static const char *alloc_names[ALLOC_COUNT] = {"malloc", "block", "veb"};
+
+typedef struct {
+	size_t	 ops;
+	double	 ns_per_op;
+	double	 p50, p99, p999, max; /* ns, negative without samples */
+	double	 misses_per_op;		  /* negative when not available */
+} result_t;
+
+/* latency samples and counters of one run */
+typedef struct {
+	double	*samples;
+	size_t	 nsamples;
+	uint64_t start;
+	int		 perf_fd;
+} run_t;
+
+static void
+shuffle(void **a, size_t n)
+{
+	for (size_t i = n; i > 1; i--) {
+		size_t j = rng_next() % i;
+		void  *t = a[i - 1];
+		a[i - 1] = a[j];
+		a[j]	 = t;
+	}
+}
+
+/* zipfian ranks in [0, n), gray et al. "quickly generating billion-record
+ * synthetic databases", as used by ycsb */
+static void
+zipf_fill(void **out, size_t n, void *const *by_rank)
+{
+	double theta = RB_BENCH_ZIPF_THETA;
+	double zetan = 0, zeta2 = 1 + pow(0.5, theta);
+
+	for (size_t i = 1; i <= n; i++) zetan += 1 / pow((double)i, theta);
+
+	double alpha = 1 / (1 - theta);
+	double eta	 = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+
+	for (size_t i = 0; i < n; i++) {
+		double u  = rng_unit();
+		double uz = u * zetan;
+		size_t r;
+		if (uz < 1)
+			r = 0;
+		else if (uz < zeta2)
+			r = 1;
+		else
+			r = (size_t)(n * pow(eta * u - eta + 1, alpha));
+		out[i] = by_rank[r < n ? r : n - 1];
+	}
+}
+
+/* the n keys of an operation, in distribution order */
+static void
+make_keys(void **out, size_t n, dist_t dist)
+{
+	for (size_t i = 0; i < n; i++)
+		out[i] = (void *)(uintptr_t)(dist == DIST_REV ? n - i : i + 1);
+	if (dist == DIST_RAND) shuffle(out, n);
+	if (dist == DIST_ZIPF) {
+		void **by_rank = malloc(n * sizeof(void *));
+		memcpy(by_rank, out, n * sizeof(void *));
+		shuffle(by_rank, n);
+		zipf_fill(out, n, by_rank);
+		free(by_rank);
+	}
+}
+
+static int
+perf_open(void)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type			= PERF_TYPE_HARDWARE;
+	attr.size			= sizeof(attr);
+	attr.config			= PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled		= 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv		= 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+static void
+run_begin(run_t *run, size_t ops)
+{
+	run->samples  = malloc((ops / RB_BENCH_SAMPLE_EVERY + 1) * sizeof(double));
+	run->nsamples = 0;
+#ifdef __linux__
+	if (run->perf_fd >= 0) {
+		ioctl(run->perf_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(run->perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+	run->start = now_ns();
+}
+
+static result_t
+run_end(run_t *run, size_t ops)
+{
+	uint64_t elapsed = now_ns() - run->start;
+	result_t r;
+
+	memset(&r, 0, sizeof(r));
+	r.ops			= ops;
+	r.ns_per_op		= ops ? (double)elapsed / ops : 0;
+	r.misses_per_op = -1;
+
+#ifdef __linux__
+	uint64_t misses;
+	if (run->perf_fd >= 0) {
+		ioctl(run->perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(run->perf_fd, &misses, sizeof(misses)) == sizeof(misses))
+			r.misses_per_op = ops ? (double)misses / ops : 0;
+	}
+#endif
+
+	size_t n = run->nsamples;
+	r.p50 = r.p99 = r.p999 = r.max = -1;
+	if (n > 0) {
+		qsort(run->samples, n, sizeof(double), cmp_double);
+		r.p50  = run->samples[n / 2];
+		r.p99  = run->samples[(size_t)(n * 0.99)];
+		r.p999 = run->samples[(size_t)(n * 0.999)];
+		r.max  = run->samples[n - 1];
+	}
+	free(run->samples);
+	return r;
+}
+
+/* runs stmt for i in [0, ops), timing one iteration out of
+ * RB_BENCH_SAMPLE_EVERY */
+#define TIMED_LOOP(run, ops, stmt)                                         \
+	do {                                                                   \
+		for (size_t i = 0; i < (ops); i++) {                               \
+			if (i % RB_BENCH_SAMPLE_EVERY == 0) {                          \
+				uint64_t t0 = now_ns();                                    \
+				stmt;                                                      \
+				(run)->samples[(run)->nsamples++] = sample_ns(t0);          \
+			} else {                                                       \
+				stmt;                                                      \
+			}                                                              \
+		}                                                                  \
+	} while (0)
+
+/* tree of the keys 1..n laid out by alloc, inserted in dist order */
+static node_t *
+make_tree(void **keys, size_t n, alloc_t alloc, node_t **block)
+{
+	node_t *root = NULL;
+
+	*block = NULL;
+	if (alloc == ALLOC_BLOCK) {
+		void **tmp = malloc(n * sizeof(void *));
+		for (size_t i = 0; i < n; i++) tmp[i] = (void *)(uintptr_t)(i + 1);
+		root = build_tree(tmp, n, 0, block);
+		free(tmp);
+		return root;
+	}
+	for (size_t i = 0; i < n; i++) insert_node(&root, keys[i]);
+	/* zipf leaves holes, fill them so every lookup tree has n keys */
+	for (size_t i = 0; i < n; i++) insert_node(&root, (void *)(uintptr_t)(i + 1));
+	if (alloc == ALLOC_VEB) {
+		node_t *copy = compact_tree(root, block);
+		free_tree(root);
+		root = copy;
+	}
+	return root;
+}
+
+static volatile uintptr_t sink;
+static FILE				 *shape_fp;
+
+static void
+dump_shape(node_t *root, dist_t dist, size_t n)
+{
+	rb_shape_t shape;
+
+	tree_shape(root, &shape);
+	fprintf(shape_fp, "{\"dist\": \"%s\", \"n\": %zu, \"shape\": ",
+			dist_names[dist], n);
+	write_shape_json(&shape, shape_fp);
+	fprintf(shape_fp, "}\n");
+}
+
+static result_t
+bench_one(op_t op, dist_t dist, alloc_t alloc, size_t n, int perf_fd)
+{
+	void  **keys = malloc(n * sizeof(void *));
+	void  **tmp	 = malloc(n * sizeof(void *));
+	node_t *range[RB_BENCH_RANGE_LEN];
+	node_t *found[RB_BENCH_BATCH];
+	node_t *root = NULL, *block = NULL;
+	run_t	run	 = {NULL, 0, 0, perf_fd};
+	size_t	ops	 = n;
+	result_t r;
+
+	make_keys(keys, n, dist);
+
+	switch (op) {
+	case OP_INSERT:
+		run_begin(&run, ops);
+		TIMED_LOOP(&run, ops, insert_node(&root, keys[i]));
+		r = run_end(&run, ops);
+		if (shape_fp) dump_shape(root, dist, n);
+		break;
+	case OP_BUILD:
+		/* one bulk build, reported per key */
+		memcpy(tmp, keys, n * sizeof(void *));
+		run_begin(&run, 0);
+		root = build_tree(tmp, n, 0, &block);
+		r	 = run_end(&run, ops);
+		break;
+	case OP_SEARCH:
+		root = make_tree(keys, n, alloc, &block);
+		run_begin(&run, ops);
+		TIMED_LOOP(&run, ops, sink += (uintptr_t)search(root, keys[i]));
+		r = run_end(&run, ops);
+		break;
+	case OP_BATCH:
+		/* a short last batch is left out, ns/op stays per key */
+		ops	 = n / RB_BENCH_BATCH * RB_BENCH_BATCH;
+		root = make_tree(keys, n, alloc, &block);
+		run_begin(&run, ops / RB_BENCH_BATCH);
+		TIMED_LOOP(&run, ops / RB_BENCH_BATCH,
+				   sink += search_batch(root, keys + i * RB_BENCH_BATCH,
+										RB_BENCH_BATCH, found));
+		r = run_end(&run, ops);
+		break;
+	case OP_FROZEN: {
+		root		   = make_tree(keys, n, alloc, &block);
+		rb_frozen_t *f = freeze_tree(root);
+		run_begin(&run, ops);
+		TIMED_LOOP(&run, ops, sink += (uintptr_t)search_frozen(f, keys[i]));
+		r = run_end(&run, ops);
+		free_frozen(f);
+		break;
+	}
+	case OP_DELETE:
+		root = make_tree(keys, n, alloc, &block);
+		run_begin(&run, ops);
+		TIMED_LOOP(&run, ops, delete_node(&root, keys[i]));
+		r = run_end(&run, ops);
+		break;
+	case OP_RANGE:
+		root = make_tree(keys, n, alloc, &block);
+		run_begin(&run, ops);
+		TIMED_LOOP(&run, ops,
+				   sink += range_search(root, range, RB_BENCH_RANGE_LEN, keys[i],
+										(char *)keys[i] + RB_BENCH_RANGE_LEN));
+		r = run_end(&run, ops);
+		break;
+	case OP_ITER: {
+		root		= make_tree(keys, n, alloc, &block);
+		node_t *it	= first_node(root);
+		run_begin(&run, ops);
+		TIMED_LOOP(&run, ops, (sink += (uintptr_t)node_key(it), it = next_node(it)));
+		r = run_end(&run, ops);
+		break;
+	}
+	default:
+		memset(&r, 0, sizeof(r));
+		break;
+	}
+
+	free_tree(root);
+	free(block);
+	free(keys);
+	free(tmp);
+	return r;
+}
+
+/* parses a comma separated list of names into a mask */
+static unsigned
+parse_names(const char *arg, const char **names, int count)
+{
+	unsigned mask = 0;
+	char	*copy = strdup(arg), *save = NULL;
+
+	for (char *tok = strtok_r(copy, ",", &save); tok;
+		 tok	   = strtok_r(NULL, ",", &save)) {
+		int i;
+		for (i = 0; i < count && strcmp(tok, names[i]) != 0; i++);
+		if (i == count) {
+			fprintf(stderr, "unknown name: %s\n", tok);
+			exit(2);
+		}
+		mask |= 1u << i;
+	}
+	free(copy);
+	return mask;
+}
+
+static size_t
+parse_sizes(const char *arg, size_t *sizes, size_t max)
+{
+	size_t n	= 0;
+	char  *copy = strdup(arg), *save = NULL;
+
+	for (char *tok = strtok_r(copy, ",", &save); tok && n < max;
+		 tok	   = strtok_r(NULL, ",", &save))
+		sizes[n++] = (size_t)strtod(tok, NULL);
+	free(copy);
+	return n;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t	 sizes[16] = {1000, 10000, 100000, 1000000};
+	size_t	 nsizes	   = 4;
+	unsigned dists	   = (1u << DIST_COUNT) - 1;
+	unsigned ops	   = (1u << OP_COUNT) - 1;
+	unsigned allocs	   = (1u << ALLOC_COUNT) - 1;
+	bool	 json	   = false;
+	int		 trace_fd  = -1;
+
+	for (int i = 1; i < argc; i++) {
+		const char *a = argv[i];
+		if (strncmp(a, "--sizes=", 8) == 0)
+			nsizes = parse_sizes(a + 8, sizes, 16);
+		else if (strncmp(a, "--dists=", 8) == 0)
+			dists = parse_names(a + 8, dist_names, DIST_COUNT);
+		else if (strncmp(a, "--ops=", 6) == 0)
+			ops = parse_names(a + 6, op_names, OP_COUNT);
+		else if (strncmp(a, "--allocs=", 9) == 0)
+			allocs = parse_names(a + 9, alloc_names, ALLOC_COUNT);
+		else if (strncmp(a, "--seed=", 7) == 0)
+			rng_state = strtoull(a + 7, NULL, 0) | 1;
+		else if (strcmp(a, "--json") == 0)
+			json = true;
+		else if (strncmp(a, "--shape=", 8) == 0) {
+			if (!(shape_fp = fopen(a + 8, "w"))) {
+				perror(a + 8);
+				return 1;
+			}
+		} else if (strncmp(a, "--trace=", 8) == 0) {
+			trace_fd = open(a + 8, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (trace_fd < 0) {
+				perror(a + 8);
+				return 1;
+			}
+		}
+		else {
+			fprintf(stderr,
+					"usage: %s [--sizes=1e3,...] [--dists=seq,rev,rand,zipf] "
+					"[--ops=insert,build,search,batch,frozen,delete,range,iter] "
+					"[--allocs=malloc,block,veb] [--seed=N] [--json] "
+					"[--shape=FILE] [--trace=FILE]\n",
+					argv[0]);
+			return 2;
+		}
+	}
+
+	int	 perf_fd = perf_open();
+	bool first	 = true;
+
+	timer_calibrate();
+
+	if (json)
+		printf("[\n");
+	else
+		printf("%-7s %-5s %-7s %10s %9s %9s %9s %9s %10s %11s\n", "op",
+			   "dist", "alloc", "n", "ns/op", "p50", "p99", "p99.9", "max",
+			   "misses/op");
+
+	for (size_t s = 0; s < nsizes; s++) {
+		for (int op = 0; op < OP_COUNT; op++) {
+			if (!(ops & (1u << op))) continue;
+			for (int d = 0; d < DIST_COUNT; d++) {
+				if (!(dists & (1u << d))) continue;
+				for (int al = 0; al < ALLOC_COUNT; al++) {
+					if (!(allocs & (1u << al))) continue;
+					if (op == OP_INSERT && al != ALLOC_MALLOC) continue;
+					if (op == OP_BUILD && al != ALLOC_BLOCK) continue;
+
+					result_t r = bench_one(op, d, al, sizes[s], perf_fd);
+					if (json) {
+						printf("%s  {\"op\": \"%s\", \"dist\": \"%s\", "
+							   "\"alloc\": \"%s\", \"n\": %zu, "
+							   "\"ns_per_op\": %.2f",
+							   first ? "" : ",\n", op_names[op], dist_names[d],
+							   alloc_names[al], sizes[s], r.ns_per_op);
+						print_json_field("p50_ns", r.p50, "%.0f");
+						print_json_field("p99_ns", r.p99, "%.0f");
+						print_json_field("p999_ns", r.p999, "%.0f");
+						print_json_field("max_ns", r.max, "%.0f");
+						print_json_field("misses_per_op", r.misses_per_op,
+										 "%.3f");
+						printf("}");
+					} else {
+						printf("%-7s %-5s %-7s %10zu %9.1f", op_names[op],
+							   dist_names[d], alloc_names[al], sizes[s],
+							   r.ns_per_op);
+						print_column(r.p50, 9, "%9.0f");
+						print_column(r.p99, 9, "%9.0f");
+						print_column(r.p999, 9, "%9.0f");
+						print_column(r.max, 10, "%10.0f");
+						print_column(r.misses_per_op, 11, "%11.2f");
+						printf("\n");
+					}
+					first = false;
+					fflush(stdout);
+				}
+			}
+		}
+	}
+	if (json) printf("\n]\n");
+	if (shape_fp) fclose(shape_fp);
+	if (trace_fd >= 0) {
+		/* the rings only hold the most recent calls of each thread */
+		if (write_trace(trace_fd) != 0) perror("write_trace");
+		close(trace_fd);
+	}
+
+#ifdef __linux__
+	if (perf_fd >= 0) close(perf_fd);
+#endif
+	return 0;
+}
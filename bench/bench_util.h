@@ -0,0 +1,83 @@
+#ifndef RB_BENCH_UTIL_H
+#define RB_BENCH_UTIL_H
+
+/* helpers shared by the benchmark drivers: rng, clock and result printing */
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+static uint64_t timer_overhead;
+
+static inline uint64_t
+rng_next(void)
+{
+	/* xorshift64* */
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static inline double
+rng_unit(void)
+{
+	return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static inline uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* smallest delta between two clock reads */
+static inline void
+timer_calibrate(void)
+{
+	timer_overhead = UINT64_MAX;
+	for (int i = 0; i < 1000; i++) {
+		uint64_t t0 = now_ns();
+		uint64_t d	= now_ns() - t0;
+		if (d < timer_overhead) timer_overhead = d;
+	}
+}
+
+static inline double
+sample_ns(uint64_t t0)
+{
+	uint64_t d = now_ns() - t0;
+	return d > timer_overhead ? (double)(d - timer_overhead) : 0;
+}
+
+static inline int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* negative values are missing measurements */
+static inline void
+print_json_field(const char *name, double v, const char *fmt)
+{
+	printf(", \"%s\": ", name);
+	if (v < 0)
+		printf("null");
+	else
+		printf(fmt, v);
+}
+
+static inline void
+print_column(double v, int width, const char *fmt)
+{
+	printf(" ");
+	if (v < 0)
+		printf("%*s", width, "n/a");
+	else
+		printf(fmt, v);
+}
+
+#endif
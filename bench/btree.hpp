@@ -0,0 +1,163 @@
+#ifndef RB_BENCH_BTREE_HPP
+#define RB_BENCH_BTREE_HPP
+
+/* b+ tree of 64 bit keys, used as a comparison point by rb_compare.
+ * nodes hold up to B keys, full nodes are split on the way down so inserts
+ * never walk back up. leaves hold the keys, inner nodes only separators (the
+ * first key of the right sibling). erase removes the key from its leaf and does
+ * not merge underfull nodes, which is what most in-memory b-trees in
+ * benchmarks do and keeps lookups exact. */
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+template <int B = 32>
+class btree_set {
+	struct node {
+		int	 n;
+		bool leaf;
+		uint64_t keys[B];
+	};
+	struct inner : node {
+		node *child[B + 1];
+	};
+
+	node *root_;
+
+	static node *
+	new_leaf()
+	{
+		node *l = new node;
+		l->n	= 0;
+		l->leaf = true;
+		return l;
+	}
+
+	static inner *
+	new_inner()
+	{
+		inner *in = new inner;
+		in->n	  = 0;
+		in->leaf  = false;
+		return in;
+	}
+
+	/* splits the full child i of p, the separator goes into p */
+	static void
+	split_child(inner *p, int i)
+	{
+		node	*c = p->child[i];
+		node	*r;
+		uint64_t sep;
+		int		 mid = B / 2;
+
+		if (c->leaf) {
+			r	 = new_leaf();
+			r->n = B - mid;
+			std::memcpy(r->keys, c->keys + mid, r->n * sizeof(uint64_t));
+			c->n = mid;
+			sep	 = r->keys[0];
+		} else {
+			inner *ci = static_cast<inner *>(c);
+			inner *ri = new_inner();
+			sep		  = ci->keys[mid];
+			ri->n	  = B - mid - 1;
+			std::memcpy(ri->keys, ci->keys + mid + 1, ri->n * sizeof(uint64_t));
+			std::memcpy(ri->child, ci->child + mid + 1,
+						(ri->n + 1) * sizeof(node *));
+			ci->n = mid;
+			r	  = ri;
+		}
+
+		std::memmove(p->keys + i + 1, p->keys + i,
+					 (p->n - i) * sizeof(uint64_t));
+		std::memmove(p->child + i + 2, p->child + i + 1,
+					 (p->n - i) * sizeof(node *));
+		p->keys[i]		= sep;
+		p->child[i + 1] = r;
+		p->n++;
+	}
+
+	static int
+	route(const node *x, uint64_t k)
+	{
+		return std::upper_bound(x->keys, x->keys + x->n, k) - x->keys;
+	}
+
+	node *
+	find_leaf(uint64_t k) const
+	{
+		node *x = root_;
+		while (!x->leaf) x = static_cast<inner *>(x)->child[route(x, k)];
+		return x;
+	}
+
+	static void
+	destroy(node *x)
+	{
+		if (!x->leaf) {
+			inner *in = static_cast<inner *>(x);
+			for (int i = 0; i <= in->n; i++) destroy(in->child[i]);
+			delete in;
+			return;
+		}
+		delete x;
+	}
+
+public:
+	btree_set() : root_(new_leaf()) {}
+	~btree_set() { destroy(root_); }
+	btree_set(const btree_set &) = delete;
+	btree_set &operator=(const btree_set &) = delete;
+
+	bool
+	insert(uint64_t k)
+	{
+		if (root_->n == B) {
+			inner *r	= new_inner();
+			r->child[0] = root_;
+			split_child(r, 0);
+			root_ = r;
+		}
+
+		node *x = root_;
+		while (!x->leaf) {
+			inner *in = static_cast<inner *>(x);
+			int	   i  = route(in, k);
+			if (in->child[i]->n == B) {
+				split_child(in, i);
+				if (k >= in->keys[i]) i++;
+			}
+			x = in->child[i];
+		}
+
+		int i = std::lower_bound(x->keys, x->keys + x->n, k) - x->keys;
+		if (i < x->n && x->keys[i] == k) return false;
+		std::memmove(x->keys + i + 1, x->keys + i,
+					 (x->n - i) * sizeof(uint64_t));
+		x->keys[i] = k;
+		x->n++;
+		return true;
+	}
+
+	bool
+	find(uint64_t k) const
+	{
+		const node *x = find_leaf(k);
+		return std::binary_search(x->keys, x->keys + x->n, k);
+	}
+
+	bool
+	erase(uint64_t k)
+	{
+		node *x = find_leaf(k);
+		int	  i = std::lower_bound(x->keys, x->keys + x->n, k) - x->keys;
+		if (i == x->n || x->keys[i] != k) return false;
+		std::memmove(x->keys + i, x->keys + i + 1,
+					 (x->n - i - 1) * sizeof(uint64_t));
+		x->n--;
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,254 @@
+/* comparative benchmark: the same workload against this red-black tree, its
+ * RB_GENERATE specialization for uint64_t keys, rb::map, std::set, std::map,
+ * an in-repo b+ tree and a skip list.
+ *
+ * for every size the n keys 1..n are inserted in random order, looked up in
+ * another random order and erased in a third one. every phase reports
+ * ns/op and sampled p50/p99/max latency, the insert phase also reports heap
+ * bytes per element (from mallinfo2, so allocator overhead is included).
+ *
+ * usage: rb_compare [--sizes=1e4,1e5,...] [--seed=N] [--json]
+ */
+#include "bench_util.h"
+#include "btree.hpp"
+#include "rbtree.h"
+#include "rbtree_gen.h"
+#include "rbtree.hpp"
+#include "skiplist.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <set>
+#include <vector>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#define RB_BENCH_SAMPLE_EVERY 32
+
+RB_GENERATE(u64tree, uint64_t, RB_LESS)
+
+namespace {
+
+/* adapters giving every structure the same insert/find/erase interface */
+struct rbtree_adapter {
+	static const char *name() { return "rbtree"; }
+	node_t *root = nullptr;
+	~rbtree_adapter() { free_tree(root); }
+	bool insert(uint64_t k) { return insert_node(&root, (void *)(uintptr_t)k); }
+	bool find(uint64_t k)
+	{
+		return search(root, (void *)(uintptr_t)k) != nullptr;
+	}
+	bool erase(uint64_t k) { return delete_node(&root, (void *)(uintptr_t)k); }
+};
+
+struct gen_adapter {
+	static const char *name() { return "rbtree_gen"; }
+	u64tree_t t;
+	gen_adapter() { u64tree_init(&t); }
+	~gen_adapter() { u64tree_clear(&t); }
+	bool insert(uint64_t k) { return u64tree_insert(&t, k); }
+	bool find(uint64_t k) { return u64tree_search(&t, k) != nullptr; }
+	bool erase(uint64_t k) { return u64tree_delete(&t, k); }
+};
+
+struct rbmap_adapter {
+	static const char *name() { return "rb::map"; }
+	rb::map<uint64_t, uint64_t> m;
+	bool insert(uint64_t k) { return m.emplace(k, k).second; }
+	bool find(uint64_t k) { return m.find(k) != m.end(); }
+	bool erase(uint64_t k) { return m.erase(k) != 0; }
+};
+
+struct set_adapter {
+	static const char *name() { return "std::set"; }
+	std::set<uint64_t> s;
+	bool insert(uint64_t k) { return s.insert(k).second; }
+	bool find(uint64_t k) { return s.find(k) != s.end(); }
+	bool erase(uint64_t k) { return s.erase(k) != 0; }
+};
+
+struct map_adapter {
+	static const char *name() { return "std::map"; }
+	std::map<uint64_t, uint64_t> m;
+	bool insert(uint64_t k) { return m.emplace(k, k).second; }
+	bool find(uint64_t k) { return m.find(k) != m.end(); }
+	bool erase(uint64_t k) { return m.erase(k) != 0; }
+};
+
+struct btree_adapter {
+	static const char *name() { return "btree"; }
+	btree_set<32> t;
+	bool insert(uint64_t k) { return t.insert(k); }
+	bool find(uint64_t k) { return t.find(k); }
+	bool erase(uint64_t k) { return t.erase(k); }
+};
+
+struct skiplist_adapter {
+	static const char *name() { return "skiplist"; }
+	skiplist_set s;
+	bool insert(uint64_t k) { return s.insert(k); }
+	bool find(uint64_t k) { return s.find(k); }
+	bool erase(uint64_t k) { return s.erase(k); }
+};
+
+struct result {
+	double ns_per_op;
+	double p50, p99, max;
+	double bytes_per_elem; /* negative when not measured */
+};
+
+/* bytes in use on the heap, negative when the allocator can not tell */
+double
+heap_bytes()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	return (double)mallinfo2().uordblks;
+#else
+	return -1;
+#endif
+}
+
+template <typename Op>
+result
+measure(const std::vector<uint64_t> &keys, Op op)
+{
+	std::vector<double> samples;
+	size_t				n = keys.size();
+	volatile bool		sink;
+
+	samples.reserve(n / RB_BENCH_SAMPLE_EVERY + 1);
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < n; i++) {
+		if (i % RB_BENCH_SAMPLE_EVERY == 0) {
+			uint64_t t0 = now_ns();
+			sink		= op(keys[i]);
+			samples.push_back(sample_ns(t0));
+		} else {
+			sink = op(keys[i]);
+		}
+	}
+	uint64_t elapsed = now_ns() - start;
+	(void)sink;
+
+	std::sort(samples.begin(), samples.end());
+	size_t p99 = (size_t)(samples.size() * 0.99);
+	result r;
+	r.ns_per_op		 = n ? (double)elapsed / n : 0;
+	r.p50			 = samples.empty() ? -1 : samples[samples.size() / 2];
+	r.p99			 = samples.empty() ? -1 : samples[p99];
+	r.max			 = samples.empty() ? -1 : samples.back();
+	r.bytes_per_elem = -1;
+	return r;
+}
+
+bool first_row = true;
+
+void
+report(bool json, const char *structure, const char *phase, size_t n,
+	   const result &r)
+{
+	if (json) {
+		printf("%s  {\"structure\": \"%s\", \"phase\": \"%s\", \"n\": %zu, "
+			   "\"ns_per_op\": %.2f",
+			   first_row ? "" : ",\n", structure, phase, n, r.ns_per_op);
+		print_json_field("p50_ns", r.p50, "%.0f");
+		print_json_field("p99_ns", r.p99, "%.0f");
+		print_json_field("max_ns", r.max, "%.0f");
+		print_json_field("bytes_per_elem", r.bytes_per_elem, "%.1f");
+		printf("}");
+	} else {
+		printf("%-10s %-6s %10zu %9.1f", structure, phase, n, r.ns_per_op);
+		print_column(r.p50, 9, "%9.0f");
+		print_column(r.p99, 9, "%9.0f");
+		print_column(r.max, 10, "%10.0f");
+		print_column(r.bytes_per_elem, 10, "%10.1f");
+		printf("\n");
+	}
+	first_row = false;
+	fflush(stdout);
+}
+
+void
+shuffled(std::vector<uint64_t> &keys, size_t n)
+{
+	keys.resize(n);
+	for (size_t i = 0; i < n; i++) keys[i] = i + 1;
+	for (size_t i = n; i > 1; i--) std::swap(keys[i - 1], keys[rng_next() % i]);
+}
+
+template <typename T>
+void
+run(size_t n, bool json)
+{
+	std::vector<uint64_t> keys;
+	T					 *t = new T;
+
+	/* the key vector is not part of the structure, take the baseline after
+	 * it is allocated */
+	shuffled(keys, n);
+	double before = heap_bytes();
+	result r	  = measure(keys, [t](uint64_t k) { return t->insert(k); });
+	if (before >= 0) r.bytes_per_elem = (heap_bytes() - before) / n;
+	report(json, T::name(), "insert", n, r);
+
+	shuffled(keys, n);
+	report(json, T::name(), "find", n,
+		   measure(keys, [t](uint64_t k) { return t->find(k); }));
+
+	shuffled(keys, n);
+	report(json, T::name(), "erase", n,
+		   measure(keys, [t](uint64_t k) { return t->erase(k); }));
+	delete t;
+}
+
+} // namespace
+
+int
+main(int argc, char **argv)
+{
+	std::vector<size_t> sizes = {10000, 100000, 1000000};
+	bool				json  = false;
+
+	for (int i = 1; i < argc; i++) {
+		const char *a = argv[i];
+		if (strncmp(a, "--sizes=", 8) == 0) {
+			sizes.clear();
+			for (const char *p = a + 8; *p;) {
+				char *end;
+				sizes.push_back((size_t)strtod(p, &end));
+				p = *end == ',' ? end + 1 : end;
+				if (end == p && *p) break;
+			}
+		} else if (strncmp(a, "--seed=", 7) == 0) {
+			rng_state = strtoull(a + 7, NULL, 0) | 1;
+		} else if (strcmp(a, "--json") == 0) {
+			json = true;
+		} else {
+			fprintf(stderr, "usage: %s [--sizes=1e4,...] [--seed=N] [--json]\n",
+					argv[0]);
+			return 2;
+		}
+	}
+
+	timer_calibrate();
+	if (json)
+		printf("[\n");
+	else
+		printf("%-10s %-6s %10s %9s %9s %9s %10s %10s\n", "structure", "phase",
+			   "n", "ns/op", "p50", "p99", "max", "bytes/elem");
+
+	for (size_t n : sizes) {
+		run<rbtree_adapter>(n, json);
+		run<gen_adapter>(n, json);
+		run<rbmap_adapter>(n, json);
+		run<set_adapter>(n, json);
+		run<map_adapter>(n, json);
+		run<btree_adapter>(n, json);
+		run<skiplist_adapter>(n, json);
+	}
+	if (json) printf("\n]\n");
+	return 0;
+}
@@ -0,0 +1,120 @@
+#ifndef RB_BENCH_SKIPLIST_HPP
+#define RB_BENCH_SKIPLIST_HPP
+
+/* skip list of 64 bit keys, used as a comparison point by rb_compare.
+ * towers grow with probability 1/4 per level, each node is one allocation
+ * sized to its own tower. */
+#include <cstdint>
+#include <cstdlib>
+
+class skiplist_set {
+	static const int MAX_LEVEL = 24;
+
+	struct node {
+		uint64_t key;
+		node	*next[1]; /* level entries */
+	};
+
+	node	*head_;
+	int		 level_;
+	uint64_t rng_;
+
+	static node *
+	new_node(uint64_t key, int level)
+	{
+		node *n = static_cast<node *>(
+			std::malloc(sizeof(node) + (level - 1) * sizeof(node *)));
+		n->key = key;
+		for (int i = 0; i < level; i++) n->next[i] = nullptr;
+		return n;
+	}
+
+	int
+	random_level()
+	{
+		/* two random bits per level */
+		rng_ ^= rng_ << 13;
+		rng_ ^= rng_ >> 7;
+		rng_ ^= rng_ << 17;
+		uint64_t bits  = rng_;
+		int		 level = 1;
+		while (level < MAX_LEVEL && (bits & 3) == 0) {
+			level++;
+			bits >>= 2;
+		}
+		return level;
+	}
+
+	/* fills update with the last node before k on every level */
+	node *
+	find_prev(uint64_t k, node **update) const
+	{
+		node *x = head_;
+		for (int i = level_ - 1; i >= 0; i--) {
+			while (x->next[i] && x->next[i]->key < k) x = x->next[i];
+			if (update) update[i] = x;
+		}
+		return x->next[0];
+	}
+
+public:
+	skiplist_set()
+		: head_(new_node(0, MAX_LEVEL)), level_(1), rng_(88172645463325252ULL)
+	{
+	}
+
+	~skiplist_set()
+	{
+		node *x = head_;
+		while (x) {
+			node *next = x->next[0];
+			std::free(x);
+			x = next;
+		}
+	}
+
+	skiplist_set(const skiplist_set &) = delete;
+	skiplist_set &operator=(const skiplist_set &) = delete;
+
+	bool
+	insert(uint64_t k)
+	{
+		node *update[MAX_LEVEL];
+		for (int i = level_; i < MAX_LEVEL; i++) update[i] = head_;
+
+		node *x = find_prev(k, update);
+		if (x && x->key == k) return false;
+
+		int level = random_level();
+		if (level > level_) level_ = level;
+		node *n = new_node(k, level);
+		for (int i = 0; i < level; i++) {
+			n->next[i]		   = update[i]->next[i];
+			update[i]->next[i] = n;
+		}
+		return true;
+	}
+
+	bool
+	find(uint64_t k) const
+	{
+		node *x = find_prev(k, nullptr);
+		return x && x->key == k;
+	}
+
+	bool
+	erase(uint64_t k)
+	{
+		node *update[MAX_LEVEL];
+		node *x = find_prev(k, update);
+		if (!x || x->key != k) return false;
+
+		for (int i = 0; i < level_ && update[i]->next[i] == x; i++)
+			update[i]->next[i] = x->next[i];
+		while (level_ > 1 && head_->next[level_ - 1] == nullptr) level_--;
+		std::free(x);
+		return true;
+	}
+};
+
+#endif
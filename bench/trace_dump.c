@@ -0,0 +1,165 @@
+/* reads a trace written by write_trace (rb_bench --trace=FILE with an
+ * RB_TRACE build) and prints, per operation, the latency percentiles, a log2
+ * histogram and the outliers next to the rotations they did.
+ *
+ * an outlier is a call slower than the threshold, p99 of its operation unless
+ * --threshold is given. the rotation columns show whether the slow calls are
+ * the ones that restructured the tree (correlation near 1) or were slow for
+ * some other reason, such as cache misses, page faults or preemption.
+ *
+ * usage: rb_trace_dump [--threshold=NS] [--top=N] FILE
+ */
+#include "rbtree_trace.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RB_DUMP_BUCKETS 40
+#define RB_DUMP_BAR		50
+
+typedef struct {
+	double	 ns;
+	uint32_t rotations;
+	uint16_t thread;
+	uint64_t start;
+} sample_t;
+
+static const char *op_names[] = {"", "insert", "delete", "search"};
+
+static int
+cmp_sample(const void *a, const void *b)
+{
+	double x = ((const sample_t *)a)->ns, y = ((const sample_t *)b)->ns;
+	return (x > y) - (x < y);
+}
+
+static double
+percentile(const sample_t *s, size_t n, double p)
+{
+	return s[(size_t)(p * (double)(n - 1))].ns;
+}
+
+static void
+dump_op(int op, sample_t *s, size_t n, double threshold, size_t top,
+		uint64_t t0, double ticks_per_ns)
+{
+	uint64_t hist[RB_DUMP_BUCKETS] = {0}, peak = 0;
+	double	 sum_l = 0, sum_r = 0, sum_ll = 0, sum_rr = 0, sum_lr = 0;
+	int		 lo = RB_DUMP_BUCKETS, hi = 0;
+
+	qsort(s, n, sizeof(*s), cmp_sample);
+	if (threshold <= 0) threshold = percentile(s, n, 0.99);
+
+	printf("%s: %zu calls, p50 %.0f ns, p99 %.0f ns, p99.9 %.0f ns, max %.0f "
+		   "ns\n",
+		   op_names[op], n, percentile(s, n, 0.5), percentile(s, n, 0.99),
+		   percentile(s, n, 0.999), s[n - 1].ns);
+
+	for (size_t i = 0; i < n; i++) {
+		int b = s[i].ns < 1 ? 0 : (int)log2(s[i].ns);
+		if (b >= RB_DUMP_BUCKETS) b = RB_DUMP_BUCKETS - 1;
+		if (++hist[b] > peak) peak = hist[b];
+		if (b < lo) lo = b;
+		if (b > hi) hi = b;
+		sum_l += s[i].ns;
+		sum_r += s[i].rotations;
+		sum_ll += s[i].ns * s[i].ns;
+		sum_rr += (double)s[i].rotations * s[i].rotations;
+		sum_lr += s[i].ns * s[i].rotations;
+	}
+	for (int b = lo; b <= hi; b++) {
+		int len = (int)((hist[b] * RB_DUMP_BAR + peak - 1) / peak);
+		printf("  %9.0f ns %10llu |%.*s\n", ldexp(1, b),
+			   (unsigned long long)hist[b], len,
+			   "##################################################");
+	}
+
+	/* rotations of the slow calls against all calls */
+	size_t	 first = n;
+	uint64_t out_r = 0;
+	while (first > 0 && s[first - 1].ns > threshold) out_r += s[--first].rotations;
+	size_t nout = n - first;
+
+	double var_l = n * sum_ll - sum_l * sum_l;
+	double var_r = n * sum_rr - sum_r * sum_r;
+	printf("  outliers > %.0f ns: %zu, rotations/call %.2f (all calls %.2f), ",
+		   threshold, nout, nout ? (double)out_r / nout : 0.0, sum_r / n);
+	if (var_l > 0 && var_r > 0)
+		printf("latency/rotation correlation %.3f\n",
+			   (n * sum_lr - sum_l * sum_r) / sqrt(var_l * var_r));
+	else
+		printf("latency/rotation correlation n/a\n");
+
+	for (size_t i = n; i > first && n - i < top; i--)
+		printf("    %10.0f ns  rotations %u  thread %u  at %.3f ms\n",
+			   s[i - 1].ns, s[i - 1].rotations, s[i - 1].thread,
+			   (double)(s[i - 1].start - t0) / ticks_per_ns / 1e6);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char		 *path		= NULL;
+	double			  threshold = 0;
+	size_t			  top		= 10;
+	char			  magic[8];
+	rb_trace_header_t hdr;
+	rb_trace_event_t *ev;
+
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--threshold=", 12) == 0)
+			threshold = strtod(argv[i] + 12, NULL);
+		else if (strncmp(argv[i], "--top=", 6) == 0)
+			top = strtoul(argv[i] + 6, NULL, 0);
+		else if (argv[i][0] != '-' && path == NULL)
+			path = argv[i];
+		else
+			path = NULL, i = argc;
+	}
+	if (path == NULL) {
+		fprintf(stderr, "usage: %s [--threshold=NS] [--top=N] FILE\n", argv[0]);
+		return 2;
+	}
+
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		perror(path);
+		return 1;
+	}
+	if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, RB_TRACE_MAGIC, 8) != 0 ||
+		fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.ticks_per_ns <= 0) {
+		fprintf(stderr, "%s: not a trace file\n", path);
+		return 1;
+	}
+	ev = malloc((hdr.count ? hdr.count : 1) * sizeof(*ev));
+	if (ev == NULL || fread(ev, sizeof(*ev), hdr.count, fp) != hdr.count) {
+		fprintf(stderr, "%s: truncated\n", path);
+		return 1;
+	}
+	fclose(fp);
+
+	uint64_t t0 = UINT64_MAX;
+	for (size_t i = 0; i < hdr.count; i++)
+		if (ev[i].start < t0) t0 = ev[i].start;
+
+	printf("%llu events, %.3f ticks/ns\n", (unsigned long long)hdr.count,
+		   hdr.ticks_per_ns);
+
+	sample_t *s = malloc((hdr.count ? hdr.count : 1) * sizeof(*s));
+	for (int op = RB_TRACE_INSERT; op <= RB_TRACE_SEARCH; op++) {
+		size_t n = 0;
+		for (size_t i = 0; i < hdr.count; i++) {
+			if (ev[i].op != op) continue;
+			s[n].ns		   = (double)(ev[i].end - ev[i].start) / hdr.ticks_per_ns;
+			s[n].rotations = ev[i].rotations;
+			s[n].thread	   = ev[i].thread;
+			s[n].start	   = ev[i].start;
+			n++;
+		}
+		if (n) dump_op(op, s, n, threshold, top, t0, hdr.ticks_per_ns);
+	}
+	free(s);
+	free(ev);
+	return 0;
+}
@@ -0,0 +1,238 @@
+/* differential test of rb::map against std::map: random sequences of
+ * try_emplace, insert_or_assign, erase, extract and node handle insert, and
+ * merge run on two maps of each kind with move-only values, and the maps are
+ * compared (contents, sizes, lower_bound, upper_bound, count) after every
+ * step.
+ *
+ * try_emplace on a present key must leave its argument alone, so a value
+ * that did not go into the map is still owned by the caller. a node handle
+ * whose insert fails comes back in the result with its key and value.
+ *
+ * copying a map, or building one from an initializer list, whose values throw
+ * partway must free every node it already made.
+ *
+ * the input is read three bytes per step like rb_fuzz: an op byte and a key
+ * folded into a small key space. the driver feeds random inputs.
+ *
+ * usage: rb_fuzz_map [--runs=N] [--seed=N] [--len=N]
+ */
+#include "rbtree.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <stdexcept>
+
+#define RB_FUZZ_MAP_KEYS 256 /* distinct keys */
+
+typedef std::unique_ptr<int>   value_t;
+typedef rb::map<int, value_t>  rb_map_t;
+typedef std::map<int, value_t> std_map_t;
+
+enum {
+	OP_TRY_EMPLACE,
+	OP_ASSIGN,
+	OP_ERASE,
+	OP_EXTRACT,
+	OP_MERGE,
+	OP_COUNT
+};
+
+static void
+fail(size_t step, const char *what, int key)
+{
+	fprintf(stderr, "step %zu: %s (key %d)\n", step, what, key);
+	abort();
+}
+
+static void
+check_same(const rb_map_t &m, const std_map_t &s, int key, size_t step)
+{
+	if (m.size() != s.size()) fail(step, "size differs", key);
+
+	std_map_t::const_iterator si = s.begin();
+	for (rb_map_t::const_iterator it = m.begin(); it != m.end(); ++it, ++si)
+		if (it->first != si->first || *it->second != *si->second)
+			fail(step, "iteration differs from std::map", it->first);
+
+	/* backwards too, the iterators walk parent links both ways */
+	std_map_t::const_reverse_iterator sr = s.rbegin();
+	for (rb_map_t::const_reverse_iterator it = m.rbegin(); it != m.rend();
+		 ++it, ++sr)
+		if (it->first != sr->first)
+			fail(step, "reverse iteration differs", it->first);
+
+	rb_map_t::const_iterator  lb = m.lower_bound(key), ub = m.upper_bound(key);
+	std_map_t::const_iterator slb = s.lower_bound(key), sub = s.upper_bound(key);
+	if ((lb == m.end()) != (slb == s.end()) ||
+		(lb != m.end() && lb->first != slb->first))
+		fail(step, "lower_bound differs", key);
+	if ((ub == m.end()) != (sub == s.end()) ||
+		(ub != m.end() && ub->first != sub->first))
+		fail(step, "upper_bound differs", key);
+	if (m.count(key) != s.count(key)) fail(step, "count differs", key);
+}
+
+/* counts live instances, the copy constructor throws once armed ones run out */
+struct counted {
+	static int live;
+	static int copies; /* copies left before one throws, -1 for never */
+	int		   v;
+
+	counted(int x) : v(x) { live++; }
+	counted(const counted &o) : v(o.v)
+	{
+		if (copies == 0) throw std::runtime_error("copy");
+		if (copies > 0) copies--;
+		live++;
+	}
+	~counted() { live--; }
+};
+int counted::live	= 0;
+int counted::copies = -1;
+
+static void
+check_throwing_copy(void)
+{
+	typedef rb::map<int, counted> counted_map_t;
+
+	counted_map_t m;
+	for (int i = 0; i < 64; i++) m.emplace(i, counted(i));
+	int live = counted::live;
+
+	for (int n = 0; n < 64; n += 7) {
+		counted::copies = n;
+		try {
+			counted_map_t copy(m);
+			fail(0, "copy did not throw", n);
+		} catch (const std::runtime_error &) {
+		}
+		try {
+			counted_map_t assigned;
+			assigned = m;
+			fail(0, "assignment did not throw", n);
+		} catch (const std::runtime_error &) {
+		}
+		if (counted::live != live) fail(0, "throwing copy leaked values", n);
+	}
+
+	/* the list itself takes three copies, the map throws on its second */
+	counted a(1), b(2), c(3);
+	live			= counted::live;
+	counted::copies = 4;
+	try {
+		counted_map_t il{{1, a}, {2, b}, {3, c}};
+		fail(0, "initializer list did not throw", 0);
+	} catch (const std::runtime_error &) {
+	}
+	counted::copies = -1;
+	if (counted::live != live)
+		fail(0, "throwing initializer list leaked values", 0);
+}
+
+static void
+run(const uint8_t *data, size_t size)
+{
+	rb_map_t  m[2];
+	std_map_t s[2];
+	int		  serial = 0;
+
+	for (size_t i = 0, step = 0; i + 3 <= size; i += 3, step++) {
+		unsigned op	 = data[i] % OP_COUNT;
+		int		 key = ((data[i + 1] << 8) | data[i + 2]) % RB_FUZZ_MAP_KEYS;
+		unsigned w	 = data[i] / OP_COUNT % 2; /* map the step works on */
+
+		switch (op) {
+		case OP_TRY_EMPLACE: {
+			value_t a(new int(++serial)), b(new int(serial));
+			int	   *held = a.get();
+			bool	ins	 = m[w].try_emplace(key, std::move(a)).second;
+			if (ins != s[w].try_emplace(key, std::move(b)).second)
+				fail(step, "try_emplace result differs", key);
+			if (ins ? a != nullptr : a.get() != held)
+				fail(step, "try_emplace moved from its argument", key);
+			break;
+		}
+		case OP_ASSIGN: {
+			++serial;
+			bool ins = m[w].insert_or_assign(key, value_t(new int(serial))).second;
+			if (ins != s[w].insert_or_assign(key, value_t(new int(serial))).second)
+				fail(step, "insert_or_assign result differs", key);
+			break;
+		}
+		case OP_ERASE:
+			if (m[w].erase(key) != s[w].erase(key))
+				fail(step, "erase result differs", key);
+			break;
+		case OP_EXTRACT: {
+			/* moves key from map w to the other one through a node handle */
+			rb_map_t::node_type	 nh	 = m[w].extract(key);
+			std_map_t::node_type snh = s[w].extract(key);
+			if (nh.empty() != snh.empty())
+				fail(step, "extract result differs", key);
+			if (nh.empty()) break;
+			if (nh.key() != key || *nh.mapped() != *snh.mapped())
+				fail(step, "extracted node differs", key);
+
+			int						*held = nh.mapped().get();
+			rb_map_t::insert_return_type r = m[!w].insert(std::move(nh));
+			std_map_t::insert_return_type sr = s[!w].insert(std::move(snh));
+			if (r.inserted != sr.inserted)
+				fail(step, "node insert result differs", key);
+			if (r.inserted ? !r.node.empty() || r.position->second.get() != held
+						   : r.node.empty() || r.node.mapped().get() != held ||
+								 r.position->first != key)
+				fail(step, "node handle not handed back", key);
+			break;
+		}
+		case OP_MERGE:
+			m[w].merge(m[!w]);
+			s[w].merge(s[!w]);
+			break;
+		}
+		check_same(m[0], s[0], key, step);
+		check_same(m[1], s[1], key, step);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64_t seed = 1, state;
+	size_t	 runs = 1000, len = 3 * 2048;
+
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--runs=", 7) == 0)
+			runs = strtoul(argv[i] + 7, NULL, 0);
+		else if (strncmp(argv[i], "--seed=", 7) == 0)
+			seed = strtoull(argv[i] + 7, NULL, 0);
+		else if (strncmp(argv[i], "--len=", 6) == 0)
+			len = strtoul(argv[i] + 6, NULL, 0);
+		else {
+			fprintf(stderr, "usage: %s [--runs=N] [--seed=N] [--len=N]\n",
+					argv[0]);
+			return 2;
+		}
+	}
+
+	check_throwing_copy();
+
+	uint8_t *buf = (uint8_t *)malloc(len ? len : 1);
+	state		 = seed | 1;
+	for (size_t r = 0; r < runs; r++) {
+		/* xorshift64*, the length varies so short inputs are covered too */
+		for (size_t i = 0; i < len; i++) {
+			state ^= state >> 12;
+			state ^= state << 25;
+			state ^= state >> 27;
+			buf[i] = (uint8_t)((state * 0x2545f4914f6cdd1dULL) >> 56);
+		}
+		size_t n = len ? buf[0] * len / 256 + 1 : 0;
+		run(buf, n < len ? n : len);
+	}
+	free(buf);
+	printf("%zu runs, seed %llu, ok\n", runs, (unsigned long long)seed);
+	return 0;
+}
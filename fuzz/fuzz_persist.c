@@ -0,0 +1,288 @@
+/* persistence round trips: random insert/delete sequences run against a set
+ * oracle, and the tree is written and read back through every on-disk path
+ * in a temporary directory:
+ *
+ *   tree file:  write_tree_file, overwritten once, then open_tree_file with
+ *               checksum verification and search_tree_file on every key.
+ *   checkpoint: write_base, a write_delta every few steps (bulk inserts and
+ *               deletes included), then load_checkpoint of the base and all
+ *               deltas.
+ *   wal:        wal_insert/wal_delete with a reset_wal in the middle, then a
+ *               corrupt and a torn record appended to the log, then
+ *               attach_wal on the saved base, which must replay to the oracle
+ *               and cut the tail so that records logged after it replay too.
+ *
+ * usage: rb_fuzz_persist [--runs=N] [--seed=N] [--len=N]
+ */
+#include "rbtree.h"
+#include "rbtree_file.h"
+#include "rbtree_stream.h"
+#include "rbtree_wal.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RB_PERSIST_KEYS	  1024 /* distinct keys */
+#define RB_PERSIST_DELTAS 8	   /* deltas per checkpoint */
+#define RB_PERSIST_BULK	  16   /* keys per bulk step */
+
+static uint64_t state;
+static char		dir[256];
+
+static uint64_t
+rnd(void)
+{
+	/* xorshift64* */
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545f4914f6cdd1dULL;
+}
+
+static void
+fail(size_t run, const char *what, uintptr_t key)
+{
+	fprintf(stderr, "run %zu: %s (key %lu)\n", run, what, (unsigned long)key);
+	abort();
+}
+
+static const char *
+path(const char *name)
+{
+	static char buf[320];
+	snprintf(buf, sizeof(buf), "%s/%s", dir, name);
+	return buf;
+}
+
+static int
+open_path(const char *name, int flags)
+{
+	return open(path(name), flags, 0644);
+}
+
+/* the tree holds exactly the keys of the oracle */
+static void
+check_tree(node_t *root, const bool *in, size_t run, const char *what)
+{
+	uintptr_t k = 0;
+
+	if (validate_tree(root) != RB_VALID) fail(run, what, 0);
+	for (node_t *n = first_node(root); n; n = next_node(n)) {
+		uintptr_t next = (uintptr_t)node_key(n);
+		while (++k < next)
+			if (in[k]) fail(run, what, k);
+		if (!in[k]) fail(run, what, k);
+	}
+	while (++k <= RB_PERSIST_KEYS)
+		if (in[k]) fail(run, what, k);
+}
+
+static void
+check_file(node_t *root, const bool *in, size_t len, size_t run)
+{
+	if (write_tree_file(NULL, path("tree.rbt")) != 0 ||
+		write_tree_file(root, path("tree.rbt")) != 0)
+		fail(run, "write_tree_file failed", 0);
+	if (access(path("tree.rbt.tmp"), F_OK) == 0)
+		fail(run, "write_tree_file left its temporary", 0);
+
+	rb_file_t *f = open_tree_file(path("tree.rbt"), true);
+	if (f == NULL) fail(run, "open_tree_file failed", 0);
+	if (tree_file_count(f) != len) fail(run, "tree file count differs", len);
+	for (uintptr_t k = 1; k <= RB_PERSIST_KEYS; k++)
+		if (search_tree_file(f, (void *)k) != in[k])
+			fail(run, "tree file search differs", k);
+	close_tree_file(f);
+}
+
+/* applies a random step to the handle and the oracle, returns the change in
+ * the number of keys */
+static long
+step(rbtree_t *t, bool *in, size_t run)
+{
+	uint64_t  r	  = rnd();
+	uintptr_t key = 1 + (r >> 8) % RB_PERSIST_KEYS;
+	void	 *keys[RB_PERSIST_BULK];
+	long	  d = 0;
+
+	switch (r % 8) {
+	case 0: /* a bulk insert of keys around key */
+	case 1: /* a bulk delete */
+		for (size_t i = 0; i < RB_PERSIST_BULK; i++) {
+			uintptr_t k = 1 + (key + i * 3) % RB_PERSIST_KEYS;
+			keys[i]		= (void *)k;
+			if (r % 8 == 0 && !in[k]) in[k] = true, d++;
+			if (r % 8 == 1 && in[k]) in[k] = false, d--;
+		}
+		if (!(r % 8 == 0 ? tree_insert_bulk : tree_delete_bulk)(
+				t, keys, RB_PERSIST_BULK, 1))
+			fail(run, "bulk step failed", key);
+		return d;
+	case 2:
+	case 3:
+	case 4:
+		if (tree_insert(t, (void *)key) != !in[key])
+			fail(run, "insert result differs", key);
+		d	    = !in[key];
+		in[key] = true;
+		return d;
+	default:
+		if (tree_delete(t, (void *)key) != in[key])
+			fail(run, "delete result differs", key);
+		d	    = -(long)in[key];
+		in[key] = false;
+		return d;
+	}
+}
+
+static void
+check_checkpoint(size_t run, size_t len)
+{
+	static bool in[RB_PERSIST_KEYS + 1];
+	int			fds[RB_PERSIST_DELTAS];
+	char		name[32];
+	size_t		count = 0;
+	rbtree_t   *t	  = create_tree(NULL, NULL);
+
+	memset(in, 0, sizeof(in));
+	for (size_t i = 0; i < len / 2; i++) count += step(t, in, run);
+
+	int fd = open_path("base", O_WRONLY | O_CREAT | O_TRUNC);
+	if (fd < 0 || write_base(t, fd) != 0) fail(run, "write_base failed", 0);
+	close(fd);
+	for (size_t d = 0; d < RB_PERSIST_DELTAS; d++) {
+		for (size_t i = 0; i < len / 2 / RB_PERSIST_DELTAS; i++)
+			count += step(t, in, run);
+		snprintf(name, sizeof(name), "delta.%zu", d);
+		fd = open_path(name, O_WRONLY | O_CREAT | O_TRUNC);
+		if (fd < 0 || write_delta(t, fd) != 0)
+			fail(run, "write_delta failed", d);
+		close(fd);
+	}
+	check_tree(tree_root(t), in, run, "handle differs from oracle");
+	check_file(tree_root(t), in, count, run);
+	destroy_tree(t);
+
+	int base = open_path("base", O_RDONLY);
+	for (size_t d = 0; d < RB_PERSIST_DELTAS; d++) {
+		snprintf(name, sizeof(name), "delta.%zu", d);
+		fds[d] = open_path(name, O_RDONLY);
+	}
+	t = load_checkpoint(base, fds, RB_PERSIST_DELTAS, 1);
+	if (t == NULL) fail(run, "load_checkpoint failed", 0);
+	check_tree(tree_root(t), in, run, "checkpoint differs from oracle");
+	destroy_tree(t);
+	close(base);
+	for (size_t d = 0; d < RB_PERSIST_DELTAS; d++) {
+		close(fds[d]);
+		snprintf(name, sizeof(name), "delta.%zu", d);
+		unlink(path(name));
+	}
+	unlink(path("base"));
+	unlink(path("tree.rbt"));
+}
+
+static void
+check_wal(size_t run, size_t len)
+{
+	static bool in[RB_PERSIST_KEYS + 1];
+	rbtree_t   *t = create_tree(NULL, NULL);
+	rb_wal_t   *w = attach_wal(t, path("log"), 1);
+	bool		based = false;
+
+	if (w == NULL) fail(run, "attach_wal failed", 0);
+	memset(in, 0, sizeof(in));
+	for (size_t i = 0; i < len; i++) {
+		uint64_t  r	  = rnd();
+		uintptr_t key = 1 + (r >> 8) % RB_PERSIST_KEYS;
+		int		  got = r & 1 ? wal_insert(w, (void *)key)
+							  : wal_delete(w, (void *)key);
+		if (got != (r & 1 ? !in[key] : in[key]))
+			fail(run, "wal result differs", key);
+		in[key] = r & 1;
+
+		/* the base takes over everything logged so far */
+		if (i == len / 2) {
+			int fd = open_path("wal.base", O_WRONLY | O_CREAT | O_TRUNC);
+			if (fd < 0 || reset_wal(w, fd) != 0)
+				fail(run, "reset_wal failed", 0);
+			close(fd);
+			based = true;
+		}
+	}
+	detach_wal(w);
+	destroy_tree(t);
+
+	/* a corrupt record and a torn one end the log, replay cuts them off */
+	char junk[20];
+	memset(junk, 0xa5, sizeof(junk));
+	int fd = open_path("log", O_WRONLY | O_APPEND);
+	if (fd < 0 || write(fd, junk, sizeof(junk)) != sizeof(junk))
+		fail(run, "log append failed", 0);
+	close(fd);
+
+	for (int replay = 0; replay < 2; replay++) {
+		if (based) {
+			fd = open_path("wal.base", O_RDONLY);
+			t  = load_checkpoint(fd, NULL, 0, 1);
+			close(fd);
+		} else {
+			t = create_tree(NULL, NULL);
+		}
+		if (t == NULL || (w = attach_wal(t, path("log"), 1)) == NULL)
+			fail(run, "wal replay failed", 0);
+		check_tree(tree_root(t), in, run, "wal replay differs from oracle");
+
+		/* logged after the cut, the second replay must see it */
+		uintptr_t key = 1 + rnd() % RB_PERSIST_KEYS;
+		if (wal_insert(w, (void *)key) != !in[key])
+			fail(run, "wal insert after replay differs", key);
+		in[key] = true;
+		detach_wal(w);
+		destroy_tree(t);
+	}
+	unlink(path("log"));
+	unlink(path("wal.base"));
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64_t seed = 1;
+	size_t	 runs = 100, len = 512;
+
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--runs=", 7) == 0)
+			runs = strtoul(argv[i] + 7, NULL, 0);
+		else if (strncmp(argv[i], "--seed=", 7) == 0)
+			seed = strtoull(argv[i] + 7, NULL, 0);
+		else if (strncmp(argv[i], "--len=", 6) == 0)
+			len = strtoul(argv[i] + 6, NULL, 0);
+		else {
+			fprintf(stderr, "usage: %s [--runs=N] [--seed=N] [--len=N]\n",
+					argv[0]);
+			return 2;
+		}
+	}
+
+	const char *tmp = getenv("TMPDIR");
+	snprintf(dir, sizeof(dir), "%s/rb_persist.XXXXXX", tmp ? tmp : "/tmp");
+	if (mkdtemp(dir) == NULL) {
+		perror(dir);
+		return 1;
+	}
+
+	state = seed | 1;
+	for (size_t r = 0; r < runs; r++) {
+		/* the length varies so empty trees and logs are covered too */
+		size_t n = rnd() % (len + 1);
+		check_checkpoint(r, n);
+		check_wal(r, n);
+	}
+	rmdir(dir);
+	printf("%zu runs, seed %llu, ok\n", runs, (unsigned long long)seed);
+	return 0;
+}
@@ -0,0 +1,600 @@
+/* differential fuzz target: random insert/delete/search sequences run
+ * against the tree and a sorted array, and the tree is validated after every
+ * step (validate_tree: colors, black heights, key order, parent links). the
+ * same steps also drive an RB_GENERATE tree, checked the same way, and a
+ * multiset tree that keeps every inserted duplicate, checked against per key
+ * counts and for insertion order among equal keys, and a finger mode handle
+ * that compacts in the background every now and then. the check steps also
+ * compare search_batch and a frozen snapshot with plain searches, check
+ * compact_tree copies of both trees, and run the set operations, split, join
+ * and range detach and erase on copies of the tree against the oracle.
+ *
+ * the input is read three bytes per step, an op byte and a 16 bit key folded
+ * into a small key space so inserts and deletes keep hitting each other. half
+ * of the inserts go through insert_or_get_hint with the last inserted node as
+ * hint.
+ *
+ * built with -DRB_LIBFUZZER the file is a libFuzzer target
+ * (clang -fsanitize=fuzzer), otherwise it has its own driver that feeds
+ * random inputs, or replays the files given on the command line.
+ *
+ * usage: rb_fuzz [--runs=N] [--seed=N] [--len=N] [FILE...]
+ */
+#include "rbtree.h"
+#include "rbtree_frozen.h"
+#include "rbtree_gen.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RB_FUZZ_KEYS  512 /* distinct keys */
+#define RB_FUZZ_RANGE 16  /* width of the range checks */
+
+enum { OP_INSERT, OP_DELETE, OP_SEARCH, OP_CHECK, OP_COUNT };
+
+RB_GENERATE(fz, uintptr_t, RB_LESS)
+
+/* sorted, unique keys */
+typedef struct {
+	uintptr_t keys[RB_FUZZ_KEYS];
+	size_t	  len;
+} oracle_t;
+
+static size_t
+oracle_find(const oracle_t *o, uintptr_t key)
+{
+	size_t lo = 0, hi = o->len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (o->keys[mid] < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static bool
+oracle_has(const oracle_t *o, uintptr_t key)
+{
+	size_t i = oracle_find(o, key);
+	return i < o->len && o->keys[i] == key;
+}
+
+static bool
+oracle_insert(oracle_t *o, uintptr_t key)
+{
+	size_t i = oracle_find(o, key);
+	if (i < o->len && o->keys[i] == key) return false;
+	memmove(&o->keys[i + 1], &o->keys[i], (o->len - i) * sizeof(uintptr_t));
+	o->keys[i] = key;
+	o->len++;
+	return true;
+}
+
+static bool
+oracle_delete(oracle_t *o, uintptr_t key)
+{
+	size_t i = oracle_find(o, key);
+	if (i == o->len || o->keys[i] != key) return false;
+	memmove(&o->keys[i], &o->keys[i + 1], (o->len - i - 1) * sizeof(uintptr_t));
+	o->len--;
+	return true;
+}
+
+/* duplicates per key of the multiset tree, its values are insertion numbers */
+typedef struct {
+	size_t count[RB_FUZZ_KEYS + 1];
+	size_t total;
+} multi_oracle_t;
+
+static void
+fail(size_t step, const char *what, uintptr_t key)
+{
+	fprintf(stderr, "step %zu: %s (key %lu)\n", step, what, (unsigned long)key);
+	abort();
+}
+
+/* black height of a generated subtree, -1 if an invariant is broken */
+static int
+fz_check(const fz_node_t *n, const fz_node_t *parent, uintptr_t lo, uintptr_t hi)
+{
+	if (n == NULL) return 1;
+	if (n->parent != parent || n->key <= lo || n->key >= hi) return -1;
+	if (n->color == RED && ((n->left && n->left->color == RED) ||
+							(n->right && n->right->color == RED)))
+		return -1;
+
+	int l = fz_check(n->left, n, lo, n->key);
+	int r = fz_check(n->right, n, n->key, hi);
+	if (l < 0 || l != r) return -1;
+	return l + (n->color == BLACK);
+}
+
+static void
+check_generated(const fz_t *t, const oracle_t *o, size_t step)
+{
+	size_t i = 0;
+
+	if (t->root && (t->root->color != BLACK ||
+					fz_check(t->root, NULL, 0, UINTPTR_MAX) < 0))
+		fail(step, "invalid generated tree", 0);
+	if (t->size != o->len) fail(step, "generated tree size differs", t->size);
+	for (fz_node_t *n = fz_first(t); n; n = fz_next(n), i++)
+		if (n->key != o->keys[i])
+			fail(step, "generated iteration differs from oracle", n->key);
+}
+
+/* in-order walk and a range search against the oracle */
+static void
+check_contents(node_t *root, const oracle_t *o, uintptr_t lo, size_t step)
+{
+	node_t *range[RB_FUZZ_RANGE];
+	size_t	i = 0;
+
+	for (node_t *n = first_node(root); n; n = next_node(n), i++)
+		if (i == o->len || (uintptr_t)node_key(n) != o->keys[i])
+			fail(step, "iteration differs from oracle", (uintptr_t)node_key(n));
+	if (i != o->len) fail(step, "iteration ended early", 0);
+
+	uintptr_t hi  = lo + RB_FUZZ_RANGE;
+	size_t	  got = range_search(root, range, RB_FUZZ_RANGE, (void *)lo,
+								 (void *)hi);
+	size_t	  j	  = oracle_find(o, lo);
+	for (i = 0; i < got; i++, j++)
+		if (j == o->len || o->keys[j] >= hi ||
+			(uintptr_t)node_key(range[i]) != o->keys[j])
+			fail(step, "range search differs from oracle", lo);
+	if (j < o->len && o->keys[j] < hi)
+		fail(step, "range search missed a key", o->keys[j]);
+
+	/* the same keys, and some that are absent, as one batch */
+	void  *keys[RB_FUZZ_RANGE];
+	size_t want = 0;
+	for (i = 0; i < RB_FUZZ_RANGE; i++) {
+		keys[i] = (void *)(lo + i);
+		want += oracle_has(o, lo + i);
+	}
+	if (search_batch(root, keys, RB_FUZZ_RANGE, range) != want)
+		fail(step, "search_batch count differs", lo);
+	for (i = 0; i < RB_FUZZ_RANGE; i++)
+		if (range[i] != search(root, keys[i]))
+			fail(step, "search_batch differs from search", lo + i);
+
+	/* and through a frozen snapshot */
+	rb_frozen_t *f = freeze_tree(root);
+	if (f == NULL || frozen_count(f) != o->len)
+		fail(step, "frozen snapshot size differs", o->len);
+	for (i = 0; i < RB_FUZZ_RANGE; i++) {
+		node_t *lb = lower_bound_frozen(f, keys[i]);
+		j		   = oracle_find(o, lo + i);
+		if (lb ? j == o->len || (uintptr_t)node_key(lb) != o->keys[j]
+			   : j != o->len)
+			fail(step, "frozen lower bound differs", lo + i);
+		if (search_frozen(f, keys[i]) != range[i])
+			fail(step, "frozen search differs from search", lo + i);
+	}
+	free_frozen(f);
+}
+
+/* keys ascend, equal keys in insertion order, and count_key and equal_range
+ * agree with the oracle */
+static void
+check_multi(node_t *root, const multi_oracle_t *m, uintptr_t key, size_t step)
+{
+	node_t *prev = NULL, *first, *end;
+	size_t	i	 = 0;
+
+	for (node_t *n = first_node(root); n; prev = n, n = next_node(n), i++)
+		if (prev && (node_key(prev) > node_key(n) ||
+					 (node_key(prev) == node_key(n) &&
+					  node_value(prev) >= node_value(n))))
+			fail(step, "multiset out of order", (uintptr_t)node_key(n));
+	if (i != m->total) fail(step, "multiset size differs", i);
+
+	size_t count = equal_range(root, (void *)key, &first, &end);
+	if (count != m->count[key] || count_key(root, (void *)key) != count)
+		fail(step, "multiset count differs", key);
+	for (i = 0; first != end; first = next_node(first), i++)
+		if (first == NULL || (uintptr_t)node_key(first) != key)
+			fail(step, "equal_range holds another key", key);
+	if (i != count) fail(step, "equal_range length differs", key);
+
+	/* range detach refuses duplicates and leaves the tree alone */
+	node_t *kept = root;
+	if (detach_range(&kept, (void *)1, (void *)UINTPTR_MAX) != NULL ||
+		erase_range(&kept, (void *)1, (void *)UINTPTR_MAX) != NULL ||
+		kept != root)
+		fail(step, "range detach took multiset nodes", key);
+
+	/* a plain node has no run length, insert_multi refuses its key */
+	node_t *plain = NULL;
+	if (!insert_node(&plain, (void *)(key + 1)) ||
+		insert_multi(&plain, (void *)(key + 1), NULL) != NULL ||
+		count_key(plain, (void *)(key + 1)) != 1)
+		fail(step, "insert_multi onto a plain node", key);
+	free_tree(plain);
+}
+
+/* membership of every key, index by key */
+typedef bool fz_set_t[RB_FUZZ_KEYS + 2];
+
+/* set trees are built in one block each, the checks free them at the end
+ * since set operations mix nodes of both inputs */
+typedef struct {
+	node_t *blocks[16];
+	size_t	len;
+} fz_blocks_t;
+
+static node_t *
+set_tree(const fz_set_t in, fz_blocks_t *b)
+{
+	void  *keys[RB_FUZZ_KEYS];
+	size_t n = 0;
+
+	for (uintptr_t k = 1; k <= RB_FUZZ_KEYS; k++)
+		if (in[k]) keys[n++] = (void *)k;
+	return build_tree(keys, n, 1, &b->blocks[b->len++]);
+}
+
+/* the tree is valid and holds exactly the keys of want */
+static void
+check_set(node_t *root, const fz_set_t want, size_t step, const char *what)
+{
+	uintptr_t k = 0;
+
+	if (validate_tree(root) != RB_VALID) fail(step, what, 0);
+	for (node_t *n = first_node(root); n; n = next_node(n)) {
+		uintptr_t next = (uintptr_t)node_key(n);
+		while (++k < next)
+			if (want[k]) fail(step, what, k);
+		if (!want[k]) fail(step, what, k);
+	}
+	while (++k <= RB_FUZZ_KEYS)
+		if (want[k]) fail(step, what, k);
+}
+
+/* a list of dropped nodes, linked through right, walks like a tree */
+static size_t
+list_length(node_t *list)
+{
+	size_t n = 0;
+	for (; list; list = next_node(list)) n++;
+	return n;
+}
+
+/* union, intersection and difference against a second set picked by key,
+ * split and join at key, and range detach and erase of [key, key + range),
+ * each on fresh copies of the oracle's tree */
+static void
+check_setops(const oracle_t *o, uintptr_t key, size_t step)
+{
+	fz_set_t a, b, want;
+	size_t	 both = 0, na = o->len, nb = 0;
+	unsigned	nthreads = 1 + (key >> 3 & 1);
+	node_t	   *dropped, *t, *left, *right, *found;
+	fz_blocks_t blocks = {{NULL}, 0};
+
+	memset(a, 0, sizeof(a));
+	memset(b, 0, sizeof(b));
+	for (size_t i = 0; i < o->len; i++) a[o->keys[i]] = true;
+	for (uintptr_t k = 1; k <= RB_FUZZ_KEYS; k++) {
+		b[k] = ((k ^ key) & 3) == 0;
+		nb += b[k];
+		both += a[k] && b[k];
+	}
+
+	for (uintptr_t k = 0; k <= RB_FUZZ_KEYS; k++) want[k] = a[k] || b[k];
+	t = union_trees(set_tree(a, &blocks), set_tree(b, &blocks), nthreads, &dropped);
+	check_set(t, want, step, "union differs from oracle");
+	if (list_length(dropped) != both)
+		fail(step, "union dropped the wrong nodes", both);
+	free_tree(t);
+	free_nodes(dropped);
+
+	for (uintptr_t k = 0; k <= RB_FUZZ_KEYS; k++) want[k] = a[k] && b[k];
+	t = intersect_trees(set_tree(a, &blocks), set_tree(b, &blocks), nthreads, &dropped);
+	check_set(t, want, step, "intersection differs from oracle");
+	if (list_length(dropped) != na + nb - both)
+		fail(step, "intersection dropped the wrong nodes", both);
+	free_tree(t);
+	free_nodes(dropped);
+
+	for (uintptr_t k = 0; k <= RB_FUZZ_KEYS; k++) want[k] = a[k] && !b[k];
+	t = difference_trees(set_tree(a, &blocks), set_tree(b, &blocks), nthreads, &dropped);
+	check_set(t, want, step, "difference differs from oracle");
+	if (list_length(dropped) != nb + both)
+		fail(step, "difference dropped the wrong nodes", both);
+	free_tree(t);
+	free_nodes(dropped);
+
+	/* split at key, then join the halves back without it */
+	found = split_tree(set_tree(a, &blocks), (void *)key, &left, &right);
+	if ((found != NULL) != a[key] ||
+		(found && (uintptr_t)node_key(found) != key))
+		fail(step, "split found the wrong node", key);
+	for (uintptr_t k = 0; k <= RB_FUZZ_KEYS; k++) want[k] = a[k] && k < key;
+	check_set(left, want, step, "left of split differs from oracle");
+	for (uintptr_t k = 0; k <= RB_FUZZ_KEYS; k++) want[k] = a[k] && k > key;
+	check_set(right, want, step, "right of split differs from oracle");
+	t = join_trees(left, right);
+	for (uintptr_t k = 0; k <= RB_FUZZ_KEYS; k++) want[k] = a[k] && k != key;
+	check_set(t, want, step, "join differs from oracle");
+	free_tree(t);
+	free_tree(found);
+
+	/* detach_range leaves a tree on each side, erase_range a list */
+	uintptr_t hi = key + RB_FUZZ_RANGE;
+	size_t	  in = 0;
+	t			 = set_tree(a, &blocks);
+	found		 = detach_range(&t, (void *)key, (void *)hi);
+	for (uintptr_t k = 0; k <= RB_FUZZ_KEYS; k++) {
+		want[k] = a[k] && k >= key && k < hi;
+		in += want[k];
+	}
+	check_set(found, want, step, "detached range differs from oracle");
+	for (uintptr_t k = 0; k <= RB_FUZZ_KEYS; k++)
+		want[k] = a[k] && (k < key || k >= hi);
+	check_set(t, want, step, "tree after detach differs from oracle");
+	free_tree(found);
+	free_tree(t);
+
+	t	  = set_tree(a, &blocks);
+	found = erase_range(&t, (void *)key, (void *)hi);
+	check_set(t, want, step, "tree after erase differs from oracle");
+	if (list_length(found) != in) fail(step, "erased list length", in);
+	for (node_t *n = found; n; n = next_node(n))
+		if ((uintptr_t)node_key(n) < key || (uintptr_t)node_key(n) >= hi ||
+			(next_node(n) && node_key(next_node(n)) <= node_key(n)))
+			fail(step, "erased list out of range or order", key);
+	free_nodes(found);
+	free_tree(t);
+	for (size_t i = 0; i < blocks.len; i++) free(blocks.blocks[i]);
+}
+
+/* a handle over build_tree and tree_insert_bulk nodes, which have no room
+ * for a value: upserting one of their keys is refused and leaves the tree
+ * intact, an absent key gets a map node */
+static void
+check_bulk_upsert(const oracle_t *o, uintptr_t key, size_t step)
+{
+	void	 *keys[RB_FUZZ_KEYS];
+	node_t	 *block, *n;
+	bool	  created;
+	uintptr_t next = key + 1;
+
+	for (size_t i = 0; i < o->len; i++) keys[i] = (void *)o->keys[i];
+	node_t	 *root = build_tree(keys, o->len, 1, &block);
+	rbtree_t *t	   = create_tree(root, block);
+	if (t == NULL) fail(step, "create_tree failed", key);
+
+	n = tree_upsert(t, (void *)key, (void *)1, &created);
+	if (oracle_has(o, key) ? n != NULL || created : n == NULL || !created)
+		fail(step, "upsert into a bulk built tree", key);
+	if (!oracle_has(o, next) && !oracle_has(o, key)) {
+		void *bulk = (void *)next;
+		tree_insert_bulk(t, &bulk, 1, 1);
+		if (tree_upsert(t, (void *)next, (void *)1, &created) != NULL)
+			fail(step, "upsert into a tree_insert_bulk node", next);
+	}
+	if (validate_tree(tree_root(t)) != RB_VALID)
+		fail(step, "upsert broke a bulk built tree", key);
+	destroy_tree(t);
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	static oracle_t		  o;
+	static multi_oracle_t mo;
+	node_t				 *root = NULL, *hint = NULL, *multi = NULL;
+	fz_t				  gen;
+	size_t				  step = 0;
+
+	/* a finger mode handle takes the same steps, compacting in the background
+	 * now and then while the next steps go on */
+	rbtree_t *h = create_tree(NULL, NULL);
+	if (h == NULL) fail(0, "create_tree failed", 0);
+	set_tree_finger(h, true);
+
+	o.len = 0;
+	memset(&mo, 0, sizeof(mo));
+	fz_init(&gen);
+	for (; size >= 3; data += 3, size -= 3, step++) {
+		uintptr_t key = 1 + (uintptr_t)((data[1] | data[2] << 8) % RB_FUZZ_KEYS);
+		bool	  got, want;
+
+		switch (data[0] % OP_COUNT) {
+		case OP_INSERT:
+			if (data[0] / OP_COUNT & 1) {
+				/* hinted by the node of the previous step, any node will do */
+				node_t *n = insert_or_get_hint(&root, hint, (void *)key, &got);
+				if (n == NULL || (uintptr_t)node_key(n) != key)
+					fail(step, "insert_or_get_hint returned the wrong node", key);
+				hint = n;
+			} else {
+				got = insert_node(&root, (void *)key);
+			}
+			want = oracle_insert(&o, key);
+			if (got != want) fail(step, "insert result differs", key);
+			if (tree_insert(h, (void *)key) != want)
+				fail(step, "finger insert result differs", key);
+			if (fz_insert(&gen, key) != want)
+				fail(step, "generated insert result differs", key);
+			if (insert_multi(&multi, (void *)key, (void *)(step + 1)) == NULL)
+				fail(step, "insert_multi failed", key);
+			mo.count[key]++;
+			mo.total++;
+			break;
+		case OP_DELETE:
+			got	 = delete_node(&root, (void *)key);
+			hint = NULL;
+			want = oracle_delete(&o, key);
+			if (got != want) fail(step, "delete result differs", key);
+			if (tree_delete(h, (void *)key) != want)
+				fail(step, "handle delete result differs", key);
+			if (fz_delete(&gen, key) != want)
+				fail(step, "generated delete result differs", key);
+			if (mo.count[key]) {
+				/* delete_node takes the oldest duplicate, erase_node any */
+				node_t *first, *end, *n;
+				equal_range(multi, (void *)key, &first, &end);
+				void *oldest = node_value(first);
+				if (data[0] / OP_COUNT & 1) {
+					n = first;
+					for (size_t k = data[1] % mo.count[key]; k; k--)
+						n = next_node(n);
+					erase_node(&multi, n);
+				} else if (!delete_node(&multi, (void *)key)) {
+					fail(step, "multiset delete failed", key);
+				} else if (equal_range(multi, (void *)key, &first, &end) &&
+						   node_value(first) <= oldest) {
+					fail(step, "multiset delete kept the oldest", key);
+				}
+				mo.count[key]--;
+				mo.total--;
+			} else if (delete_node(&multi, (void *)key)) {
+				fail(step, "multiset delete of an absent key", key);
+			}
+			break;
+		case OP_SEARCH: {
+			node_t *n = search(root, (void *)key);
+			if ((n != NULL) != oracle_has(&o, key))
+				fail(step, "search result differs", key);
+			if (n && (uintptr_t)node_key(n) != key)
+				fail(step, "search found the wrong node", key);
+			if ((tree_search(h, (void *)key) != NULL) != oracle_has(&o, key))
+				fail(step, "handle search result differs", key);
+			fz_node_t *g = fz_lower_bound(&gen, key);
+			size_t	   j = oracle_find(&o, key);
+			if (g ? j == o.len || g->key != o.keys[j] : j != o.len)
+				fail(step, "generated lower bound differs", key);
+			break;
+		}
+		case OP_CHECK: {
+			check_contents(root, &o, key, step);
+			check_generated(&gen, &o, step);
+			check_multi(multi, &mo, key, step);
+			check_bulk_upsert(&o, key, step);
+
+			/* a running compaction only reads the tree, searches go on */
+			check_contents(tree_root(h), &o, key, step);
+			if (key % 4 == 1)
+				tree_compact_begin(h);
+			else if (key % 4 == 3)
+				tree_compact_end(h);
+			/* a dozen fresh trees per call, one check in eight is enough */
+			if (key % 8 == 0) check_setops(&o, key, step);
+
+			/* van emde boas copies hold the same trees */
+			node_t *block, *copy = compact_tree(root, &block);
+			if ((copy == NULL) != (o.len == 0) || validate_tree(copy) != RB_VALID)
+				fail(step, "invalid compacted tree", 0);
+			check_contents(copy, &o, key, step);
+			free(block);
+			copy = compact_tree(multi, &block);
+			if (validate_tree(copy) != RB_VALID)
+				fail(step, "invalid compacted multiset", 0);
+			check_multi(copy, &mo, key, step);
+			free(block);
+			break;
+		}
+		}
+
+		rb_validation_t v = validate_tree(root);
+		if (v != RB_VALID) {
+			fprintf(stderr, "step %zu: invalid tree, violations 0x%x\n", step,
+					(unsigned)v);
+			abort();
+		}
+		if ((v = validate_tree(tree_root(h))) != RB_VALID) {
+			fprintf(stderr, "step %zu: invalid handle tree, violations 0x%x\n",
+					step, (unsigned)v);
+			abort();
+		}
+		if ((v = validate_tree(multi)) != RB_VALID) {
+			fprintf(stderr, "step %zu: invalid multiset, violations 0x%x\n",
+					step, (unsigned)v);
+			abort();
+		}
+	}
+	check_contents(root, &o, 1, step);
+	check_generated(&gen, &o, step);
+	tree_compact_end(h);
+	check_contents(tree_root(h), &o, 1, step);
+	destroy_tree(h);
+	free_tree(root);
+	free_tree(multi);
+	fz_clear(&gen);
+	return 0;
+}
+
+#ifndef RB_LIBFUZZER
+static int
+replay(const char *path)
+{
+	FILE	*fp = fopen(path, "rb");
+	uint8_t *buf;
+	long	 len;
+
+	if (fp == NULL || fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0) {
+		perror(path);
+		return 1;
+	}
+	rewind(fp);
+	buf = malloc(len ? (size_t)len : 1);
+	if (fread(buf, 1, (size_t)len, fp) != (size_t)len) {
+		perror(path);
+		return 1;
+	}
+	fclose(fp);
+	LLVMFuzzerTestOneInput(buf, (size_t)len);
+	free(buf);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64_t seed = 1, state;
+	size_t	 runs = 1000, len = 3 * 2048;
+	int		 files = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--runs=", 7) == 0)
+			runs = strtoul(argv[i] + 7, NULL, 0);
+		else if (strncmp(argv[i], "--seed=", 7) == 0)
+			seed = strtoull(argv[i] + 7, NULL, 0);
+		else if (strncmp(argv[i], "--len=", 6) == 0)
+			len = strtoul(argv[i] + 6, NULL, 0);
+		else if (argv[i][0] != '-') {
+			if (replay(argv[i]) != 0) return 1;
+			files++;
+		} else {
+			fprintf(stderr,
+					"usage: %s [--runs=N] [--seed=N] [--len=N] [FILE...]\n",
+					argv[0]);
+			return 2;
+		}
+	}
+	if (files) return 0;
+
+	uint8_t *buf = malloc(len ? len : 1);
+	state		 = seed | 1;
+	for (size_t r = 0; r < runs; r++) {
+		/* xorshift64*, the length varies so short inputs are covered too */
+		for (size_t i = 0; i < len; i++) {
+			state ^= state >> 12;
+			state ^= state << 25;
+			state ^= state >> 27;
+			buf[i] = (uint8_t)((state * 0x2545f4914f6cdd1dULL) >> 56);
+		}
+		size_t n = len ? buf[0] * len / 256 + 1 : 0;
+		LLVMFuzzerTestOneInput(buf, n < len ? n : len);
+	}
+	free(buf);
+	printf("%zu runs, seed %llu, ok\n", runs, (unsigned long long)seed);
+	return 0;
+}
+#endif
@@ -1,9 +1,15 @@
 #include "rbtree.h"
+#include "rbtree_internal.h"
 #include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 /* https://en.wikipedia.org/wiki/Red%E2%80%93black_tree
  * Definition of a red-black tree
@@ -22,23 +28,9 @@
  * 	2- if the node has a red aunt, we color-flip
  */
 
-/* bit flags for each type of violation, -- used for experiments -- */
-/* clang-format off */
-typedef enum {
-    RB_VALID                = 0x00, /* 00000000: no violations, clean state. */
-    RB_INVALID_COLOR        = 0x01, /* 00000001: rule 1 - invalid color. */
-    RB_RED_ROOT             = 0x02, /* 00000010: rule 2 - root is red. */
-    RB_NULL_NOT_BLACK       = 0x04, /* 00000100: rule 3 - leaf (NULL) nodes must be black. */
-    RB_RED_CHILD_OF_RED     = 0x08, /* 00001000: rule 4/7 - red node has a red child. */
-    RB_UNEQUAL_BLACK_PATHS  = 0x10  /* 00010000: rule 5 - black nodes in all paths are unequal. */
-} rb_violation_t;
-/* clang-format on */
-
-typedef uint32_t rb_validation_t;
-/* if rb_validation_t is RB_RED_ROOT | RB_RED_CHILD_OF_RED
- * x =  00000010 | 00001000
- * x = 00001010
- */
+#ifdef RB_STATS
+_Thread_local rb_stats_t *rb_stats_current;
+#endif
 
 /* holds rotation types  */
 typedef enum {
@@ -46,27 +38,64 @@ typedef enum {
 	RIGHT
 } rotation_t;
 
-/* tree node definition */
-struct node_t {
-	void   *key;	/* key/value */
-	node_t *parent; /* parent*/
-	node_t *left;	/* left subtree */
-	node_t *right;	/* right subtree */
-	color_t color;	/* either red or black, always black for null or tree
-					   root node */
-};
+/* shared, read-only state of a bulk build */
+typedef struct {
+	void  **keys;	   /* sorted, unique keys */
+	node_t *nodes;	   /* preallocated node array, filled in preorder */
+	int		red_depth; /* nodes at this depth are red, -1 if none */
+} rb_build_ctx_t;
+
+/* a detached subtree with a black root, and its black height (black nodes on
+ * any path from the root down to a NULL leaf, root included) */
+typedef struct {
+	node_t *root;
+	int		bh;
+} rb_sub_t;
+
+/* list of nodes dropped by a tree operation, linked through right */
+typedef struct {
+	node_t *head;
+	node_t *tail;
+} rb_batch_t;
+
+/* set operations on two detached trees */
+typedef enum {
+	RB_UNION,
+	RB_INTERSECTION,
+	RB_DIFFERENCE
+} rb_setop_t;
 
 /* forward declarations */
 /* clang-format off */
-static void rb_insert_node(node_t *root, node_t *newnode);
+static node_t *rb_insert_key(node_t **root, node_t *from, void *key, bool pair, bool *created);
+static node_t *rb_insert_hint(node_t **root, node_t *hint, void *key, bool pair, bool *created);
+static node_t *rb_insert_at(node_t **root, node_t *hint, bool climb, void *key, bool pair, void *value, bool *created);
+static void rb_link(node_t **root, node_t *parent, node_t *n);
+static node_t *rb_lower_bound(node_t *n, void *key);
+static node_t *rb_floor(node_t *n, void *key);
+static void rb_erase(node_t **root, node_t *n);
+static rb_validation_t rb_validate_runs(node_t *root);
+static void rb_tree_settle(rbtree_t *t);
 static void rb_validate_tree(node_t *root, rb_validation_t *violations);
-static void rb_validate_tree_recursive(node_t *root, rb_validation_t *violations, int *black_h);
+static void rb_validate_tree_recursive(node_t *root, rb_validation_t *violations, int *black_h, void *lo, void *hi);
 static color_t rb_get_uncle_color(node_t *n);
 static void rb_color_flip(node_t *root);
 static void rb_rotate(node_t *node, rotation_t dir);
-static void rb_rebalance(node_t *node);
+static bool rb_rebalance(node_t *node);
+static void rb_delete_node(node_t **root, node_t *z);
+static void rb_delete_fixup(node_t **root, node_t *x, node_t *xparent);
+#ifdef RB_DEBUG
+static void rb_report_violations(rb_validation_t violations);
+#endif
 static bool rb_validate_black_height(node_t *root, int black_height);
 static int rb_get_black_height(node_t *root);
+static int rb_key_cmp(const void *a, const void *b);
+static void rb_sort_keys(void **keys, void **tmp, size_t n, int spawn);
+static node_t *rb_build_subtree(const rb_build_ctx_t *ctx, size_t lo, size_t hi, size_t slot, node_t *parent, int depth, int spawn);
+static rb_sub_t rb_join(rb_sub_t l, node_t *k, rb_sub_t r);
+static rb_sub_t rb_join2(rb_sub_t l, rb_sub_t r);
+static node_t *rb_split(rb_sub_t t, void *key, rb_sub_t *l, rb_sub_t *r);
+static rb_sub_t rb_setop(rb_setop_t op, rb_sub_t a, rb_sub_t b, int spawn, rb_batch_t *dropped);
 /* clang-format on  */
 
 node_t *
@@ -76,123 +105,520 @@ create_node(void *val)
 
 	node_t *n = (node_t *)malloc(sizeof(node_t));
 	if (n == NULL) return NULL;
+	RB_STAT_ADD(allocations, 1);
 
 	n->key	  = val;
 	n->parent = n->right = n->left = NULL;
+	n->pooled	 = false;
+	n->has_value = false;
+	n->multi	 = false;
 
 	return n;
 }
 
-void
+bool
 insert_node(node_t **root, void *val)
 {
-	node_t *newnode = create_node(val);
-	assert(newnode);
+	RB_TRACE_BEGIN();
+	bool created;
 
-	if (*root == NULL) {
-		/* first node becomes root and must be black */
-		newnode->color = BLACK;
-		*root		   = newnode;
-		return;
-	}
-	rb_insert_node(*root, newnode);
-	/* validate tree after insertion */
+	assert(val);
+	rb_insert_key(root, *root, val, false, &created);
 
-	/* assume tree is valid, why not */
-    rb_validation_t violations = RB_VALID;
+#ifdef RB_DEBUG
+	/* validate tree after insertion, O(n) so only for experiments */
+	rb_validation_t violations = RB_VALID;
 	rb_validate_tree(*root, &violations);
-	
-    if (violations == RB_VALID) {
-        printf("tree is a valid rb tree\n");
-        return;
-    }
-    
-    printf("tree validation failed.\n");
-    
-    /* Check each violation flag */
-    if (violations & RB_RED_ROOT) {
-        printf("- root is red (violates property 2)\n");
-    }
-    
-    if (violations & RB_RED_CHILD_OF_RED) {
-        printf("- found red node with red child (violates properties 4/7)\n");
-    }
-    
-    if (violations & RB_UNEQUAL_BLACK_PATHS) {
-        printf("- paths have different number of black nodes (violates property 5)\n");
-    }
-    
-    if (violations & RB_INVALID_COLOR) {
-        printf("- found node with invalid color (violates property 1)\n");
-    }
-    
-    if (violations & RB_NULL_NOT_BLACK) {
-        printf("- found null leaf that isn't black (violates property 3)\n");
-    }
+	rb_report_violations(violations);
+#endif
+	RB_TRACE_END(RB_TRACE_INSERT);
+	return created;
+}
 
-	/* the fix should be on the newly node that was inserted */
-	/* 	so instead of passing the root to the below functions, we should pass
-	 * the newnode */
-	
+/* map mode: the value is stored next to the key in the node, an existing key
+ * keeps its node and gets the new value */
+bool
+insert_pair(node_t **root, void *key, void *value)
+{
+	bool created;
+
+	upsert_hint(root, NULL, key, value, &created);
+	return created;
 }
 
-void
-delete_node(node_t *root, void *val)
+node_t *
+insert_or_get(node_t **root, void *key, bool *created)
+{
+	return insert_or_get_hint(root, NULL, key, created);
+}
+
+node_t *
+insert_or_get_hint(node_t **root, node_t *hint, void *key, bool *created)
+{
+	return rb_insert_at(root, hint, true, key, false, NULL, created);
+}
+
+node_t *
+upsert(node_t **root, void *key, void *value, bool *created)
+{
+	return upsert_hint(root, NULL, key, value, created);
+}
+
+node_t *
+upsert_hint(node_t **root, node_t *hint, void *key, void *value, bool *created)
+{
+	return rb_insert_at(root, hint, true, key, true, value, created);
+}
+
+bool
+search_value(node_t *root, void *key, void **value)
+{
+	node_t *n = search(root, key);
+
+	if (n == NULL || !n->has_value) return false;
+	if (value) *value = ((rb_pair_t *)n)->value;
+	return true;
+}
+
+void *
+node_value(const node_t *n)
+{
+	return n->has_value ? ((const rb_pair_t *)n)->value : NULL;
+}
+
+bool
+set_node_value(node_t *n, void *value)
+{
+	if (!n->has_value) return false;
+	((rb_pair_t *)n)->value = value;
+	return true;
+}
+
+bool
+delete_node(node_t **root, void *val)
 {
+	RB_TRACE_BEGIN();
+	node_t	*n	   = *root;
+	uint64_t depth = 0;
+
+	while (n != NULL && n->key != val) {
+		RB_PREFETCH_CHILDREN(n);
+		RB_STAT_ADD(comparisons, 1);
+		n = val < n->key ? n->left : n->right;
+		depth++;
+	}
+	RB_STAT_MAX(max_depth, depth + (n != NULL));
+	if (n == NULL) {
+		RB_TRACE_END(RB_TRACE_DELETE);
+		return false;
+	}
+	if (n->multi) {
+		/* no ancestor of n holds val, so the older duplicates are all in
+		 * n's left subtree. the oldest one goes */
+		for (node_t *l = n->left; l;) {
+			if (l->key < val) {
+				l = l->right;
+			} else {
+				n = l;
+				l = l->left;
+			}
+		}
+	}
+	rb_erase(root, n);
+	RB_TRACE_END(RB_TRACE_DELETE);
+	return true;
 }
+
 void
+erase_node(node_t **root, node_t *n)
+{
+	RB_TRACE_BEGIN();
+	rb_erase(root, n);
+	RB_TRACE_END(RB_TRACE_DELETE);
+}
+
+/* multiset mode: equal keys go right, so the new node lands after every node
+ * already holding key, and the last node where the descent went right is its
+ * in-order predecessor. if that holds key too it passes the run length on */
+node_t *
+insert_multi(node_t **root, void *key, void *value)
+{
+	RB_TRACE_BEGIN();
+	node_t	*n = *root, *parent = NULL, *prev = NULL;
+	uint64_t depth = 1;
+
+	assert(key);
+	while (n != NULL) {
+		parent = n;
+		RB_PREFETCH_CHILDREN(n);
+		RB_STAT_ADD(comparisons, 1);
+		if (key < n->key) {
+			n = n->left;
+		} else {
+			prev = n;
+			n	 = n->right;
+		}
+		depth++;
+	}
+	RB_STAT_MAX(max_depth, depth);
+
+	/* a plain node has no run length to carry on */
+	if (prev && prev->key == key && !prev->multi) {
+		RB_TRACE_END(RB_TRACE_INSERT);
+		return NULL;
+	}
+
+	rb_multi_t *m = malloc(sizeof(rb_multi_t));
+	if (m == NULL) {
+		errno = ENOMEM;
+		RB_TRACE_END(RB_TRACE_INSERT);
+		return NULL;
+	}
+	n			  = &m->pair.node;
+	n->key		  = key;
+	n->has_value  = true;
+	n->multi	  = true;
+	m->pair.value = value;
+	m->run		  = 1;
+	if (prev && prev->key == key) {
+		m->run += ((rb_multi_t *)prev)->run;
+		((rb_multi_t *)prev)->run = 0;
+	}
+	rb_link(root, parent, n);
+
+#ifdef RB_DEBUG
+	rb_validation_t violations = RB_VALID;
+	rb_validate_tree(*root, &violations);
+	rb_report_violations(violations);
+#endif
+	RB_TRACE_END(RB_TRACE_INSERT);
+	return n;
+}
+
+size_t
+count_key(node_t *root, void *key)
+{
+	node_t *last = rb_floor(root, key);
+
+	if (last == NULL || last->key != key) return 0;
+	return last->multi ? ((rb_multi_t *)last)->run : 1;
+}
+
+size_t
+equal_range(node_t *root, void *key, node_t **first, node_t **end)
+{
+	node_t *last  = rb_floor(root, key);
+	size_t	count = count_key(root, key);
+
+	*end   = last ? next_node(last) : first_node(root);
+	*first = count > 1 ? rb_lower_bound(root, key) : count ? last : *end;
+	return count;
+}
+node_t *
 search(node_t *n, void *query_key)
 {
+	RB_TRACE_BEGIN();
+	uint64_t depth = 0;
+
+	/* no RB_PREFETCH here: the descent is branch-free and back to back
+	 * searches already overlap their misses, prefetching the sibling too only
+	 * takes fill buffers away from them */
+	RB_STAT_ADD(lookups, 1);
+	while (n != NULL && n->key != query_key) {
+		RB_STAT_ADD(comparisons, 1);
+		n = query_key < n->key ? n->left : n->right;
+		depth++;
+	}
+	RB_STAT_MAX(max_depth, depth + (n != NULL));
+	RB_TRACE_END(RB_TRACE_SEARCH);
+	return n;
 }
-void
-range_search(node_t *n, node_t **out_list, void *query_key)
+
+/* descents search_batch keeps in flight */
+#define RB_BATCH_LANES 16
+
+/* asynchronous memory access chaining: every lane holds one descent and
+ * moves it down one level per round, prefetching the node it lands on. by
+ * the time the round comes back to a lane the other lanes' work has hidden
+ * its miss. a finished lane takes the next key right away, so early hits
+ * and short paths do not leave lanes idle */
+size_t
+search_batch(node_t *root, void **keys, size_t n, node_t **out)
+{
+	node_t *cur[RB_BATCH_LANES];
+	size_t	idx[RB_BATCH_LANES];
+	size_t	next = 0, found = 0;
+	int		lanes;
+
+	RB_STAT_ADD(lookups, n);
+	for (lanes = 0; lanes < RB_BATCH_LANES && next < n; lanes++, next++) {
+		cur[lanes] = root;
+		idx[lanes] = next;
+	}
+	while (lanes > 0) {
+		for (int i = 0; i < lanes;) {
+			node_t *x	= cur[i];
+			void   *key = keys[idx[i]];
+
+			if (x == NULL || x->key == key) {
+				out[idx[i]] = x;
+				found += x != NULL;
+				if (next < n) {
+					cur[i] = root;
+					idx[i] = next++;
+					i++;
+				} else {
+					/* no keys left, the last lane moves into this one */
+					lanes--;
+					cur[i] = cur[lanes];
+					idx[i] = idx[lanes];
+				}
+				continue;
+			}
+			RB_STAT_ADD(comparisons, 1);
+			x = key < x->key ? x->left : x->right;
+			__builtin_prefetch(x);
+			cur[i++] = x;
+		}
+	}
+	return found;
+}
+
+size_t
+range_search(node_t *n, node_t **out_list, size_t max, void *lo, void *hi)
+{
+	size_t count = 0;
+
+	for (n = rb_lower_bound(n, lo); n && n->key < hi && count < max;
+		 n = next_node(n))
+		out_list[count++] = n;
+	return count;
+}
+
+/* first node with a key >= key, the oldest duplicate in a multiset tree */
+static node_t *
+rb_lower_bound(node_t *n, void *key)
+{
+	node_t *lb = NULL;
+
+	while (n != NULL) {
+		if (n->key < key) {
+			n = n->right;
+		} else {
+			lb = n;
+			n  = n->left;
+		}
+	}
+	return lb;
+}
+
+/* last node with a key <= key, the newest duplicate in a multiset tree */
+static node_t *
+rb_floor(node_t *n, void *key)
+{
+	node_t *floor = NULL;
+
+	while (n != NULL) {
+		if (key < n->key) {
+			n = n->left;
+		} else {
+			floor = n;
+			n	  = n->right;
+		}
+	}
+	return floor;
+}
+
+node_t *
+first_node(node_t *root)
+{
+	if (root == NULL) return NULL;
+	while (root->left) root = root->left;
+	return root;
+}
+
+/* in-order successor through the parent pointers */
+node_t *
+next_node(node_t *n)
+{
+	if (n->right) return first_node(n->right);
+	while (n->parent && n == n->parent->right) n = n->parent;
+	return n->parent;
+}
+
+node_t *
+prev_node(node_t *n)
+{
+	if (n->left) {
+		n = n->left;
+		while (n->right) n = n->right;
+		return n;
+	}
+	while (n->parent && n == n->parent->left) n = n->parent;
+	return n->parent;
+}
+
+void *
+node_key(const node_t *n)
+{
+	return n->key;
+}
+
+/* hangs a new node for key under parent (NULL for an empty tree) and
+ * rebalances. the slot on the key's side of parent must be free. the node is
+ * an rb_pair_t in map mode. NULL only if the allocation failed */
+static node_t *
+rb_link_key(node_t **root, node_t *parent, void *key, bool pair, bool *created)
 {
+	node_t *n = malloc(pair ? sizeof(rb_pair_t) : sizeof(node_t));
+
+	*created = false;
+	if (n == NULL) {
+		/* tells the failure apart from a key that was already there */
+		errno = ENOMEM;
+		return NULL;
+	}
+	RB_STAT_ADD(allocations, 1);
+	RB_STAT_ADD(inserts, 1);
+
+	n->key		 = key;
+	n->has_value = pair;
+	n->multi	 = false;
+	if (pair) ((rb_pair_t *)n)->value = NULL;
+	*created = true;
+	rb_link(root, parent, n);
+	return n;
 }
 
-/* this function does a simple bst insertion, the caller then validate the tree
- * after insertion */
+/* links the fresh node n (key set) under parent, or as the root of an empty
+ * tree, and rebalances */
 static void
-rb_insert_node(node_t *root, node_t *newnode)
+rb_link(node_t **root, node_t *parent, node_t *n)
+{
+	n->left	  = n->right = NULL;
+	n->parent = parent;
+	n->pooled = false;
+
+	if (parent == NULL) {
+		/* first node becomes root and must be black */
+		n->color = BLACK;
+		*root	 = n;
+		return;
+	}
+	if (n->key < parent->key)
+		parent->left = n;
+	else
+		parent->right = n;
+
+	/* RB tree insertion rules:
+	 * 1. new node is red
+	 * 2. fix RB properties if violated, starting at the new node. a rotation
+	 * near the top may have moved the root down one level
+	 */
+	n->color = RED;
+	rb_rebalance(n);
+	while ((*root)->parent) *root = (*root)->parent;
+}
+
+/* bst descent for key from the node from, whose subtree must cover key. if
+ * key is already in the tree its node is returned, otherwise a new node is
+ * linked where the descent ended */
+static node_t *
+rb_insert_key(node_t **root, node_t *from, void *key, bool pair, bool *created)
 {
-	node_t *current = root;
-	node_t *parent	= NULL;
+	node_t	*current = from;
+	node_t	*parent	 = NULL;
+	uint64_t depth	 = 1;
 
 	/* find insertion point */
 	while (current != NULL) {
 		parent = current;
-		if (newnode->key < current->key)
+		RB_PREFETCH_CHILDREN(current);
+		RB_STAT_ADD(comparisons, 1);
+		if (key < current->key)
 			current = current->left;
-		else if (newnode->key > current->key)
+		else if (key > current->key)
 			current = current->right;
-		else
-			return;
+		else {
+			*created = false;
+			return current;
+		}
+		depth++;
 	}
+	RB_STAT_MAX(max_depth, depth);
 
-	/* set parent relationship */
-	newnode->parent = parent;
+	return rb_link_key(root, parent, key, pair, created);
+}
 
-	/* insert node in correct position */
-	if (newnode->key < parent->key) {
-		parent->left = newnode;
-	} else {
-		parent->right = newnode;
-	}
+/* finger search: climbs from hint to the lowest node whose subtree covers
+ * key, then descends from there. a subtree's bound on key's side is the
+ * first ancestor reached through an edge from that side, so the climb skips
+ * the edges from the other side and stops at the first bound that holds.
+ * when key falls between hint and its in-order neighbour the descent starts
+ * at hint itself, and links right under it if that child slot is free. the
+ * climb costs O(log d) for a key d positions away from hint */
+static node_t *
+rb_insert_hint(node_t **root, node_t *hint, void *key, bool pair, bool *created)
+{
+	if (hint == NULL) return rb_insert_key(root, *root, key, pair, created);
 
-	/* RB tree insertion rules:
-	 * 1. new node is red
-	 * 2. fix RB properties if violated (this happens in the caller fucntion
-	 * after this routeine retruns)
-	 */
-	newnode->color = RED;
+	bool	right = key > hint->key;
+	node_t *from  = hint, *x = hint;
+
+	for (;;) {
+		while (x->parent && x == (right ? x->parent->right : x->parent->left))
+			x = x->parent;
+		node_t *p = x->parent;
+		RB_STAT_ADD(comparisons, 1);
+		if (p == NULL || (right ? key < p->key : key > p->key)) break;
+		/* key lies beyond p, whose subtree covers it on this side */
+		from = x = p;
+	}
+	return rb_insert_key(root, from, key, pair, created);
 }
 
 
+/* every insert that takes a hint ends up here. with climb false the descent
+ * starts at hint right away, the caller knows its subtree covers key (the
+ * first or last node of the tree for a key beyond it) */
+static node_t *
+rb_insert_at(node_t **root, node_t *hint, bool climb, void *key, bool pair,
+			 void *value, bool *created)
+{
+	RB_TRACE_BEGIN();
+	bool	c;
+	node_t *n;
+
+	assert(key);
+	if (climb || hint == NULL)
+		n = rb_insert_hint(root, hint, key, pair, &c);
+	else
+		n = rb_insert_key(root, hint, key, pair, &c);
+	if (n && pair) {
+		/* a node from insert_node or build_tree has no room for a value,
+		 * the key stays as it is and the caller gets NULL */
+		if (n->has_value)
+			((rb_pair_t *)n)->value = value;
+		else
+			n = NULL;
+	}
+	if (created) *created = c;
+
+#ifdef RB_DEBUG
+	rb_validation_t violations = RB_VALID;
+	rb_validate_tree(*root, &violations);
+	rb_report_violations(violations);
+#endif
+	RB_TRACE_END(RB_TRACE_INSERT);
+	return n;
+}
+
 static int
 rb_get_black_height(node_t *root)
 {
 	node_t *curr = root;
 	int black_height = 0;
-	while (curr->left) {
+	while (curr) {
 		if (!IS_RED(curr)) black_height++;
 		curr = curr->left;
 	}
@@ -221,8 +647,8 @@ rb_validate_tree(node_t *root, rb_validation_t *violations)
 
 	/* vrify root has no parent */
 	if (root->parent != NULL) {
-		printf("root node has parent pointer!\n");
-		assert(0);
+		*violations &= ~RB_VALID;
+		*violations |= RB_BAD_PARENT;
 	}
 
 	/*get black hegiht */
@@ -235,12 +661,31 @@ rb_validate_tree(node_t *root, rb_validation_t *violations)
     }
 	
 	/* check all other properties recursively */
-	rb_validate_tree_recursive(root, violations, &black_height);
+	rb_validate_tree_recursive(root, violations, &black_height, NULL, NULL);
+	if (root->multi) *violations |= rb_validate_runs(root);
+}
+
+/* in-order pass over a multiset tree, the last node of every run of equal
+ * keys must hold the run's length and every other node 0 */
+static rb_validation_t
+rb_validate_runs(node_t *root)
+{
+	size_t len = 0;
+
+	for (node_t *n = first_node(root), *next; n; n = next) {
+		next = next_node(n);
+		len++;
+		size_t want = next && next->key == n->key ? 0 : len;
+		if (!n->multi || ((rb_multi_t *)n)->run != want) return RB_BAD_RUN;
+		if (want) len = 0;
+	}
+	return RB_VALID;
 }
 
-/* dfs with preorder traversal  */
+/* dfs with preorder traversal, every key of the subtree must lie strictly
+ * between lo and hi (NULL for no bound) */
 static void
-rb_validate_tree_recursive(node_t *root, rb_validation_t *violations, int *black_h)
+rb_validate_tree_recursive(node_t *root, rb_validation_t *violations, int *black_h, void *lo, void *hi)
 {
 	if (!root) {
         /* If black height is not zero at leaf, tree is invalid */
@@ -257,6 +702,20 @@ rb_validate_tree_recursive(node_t *root, rb_validation_t *violations, int *black
         *violations |= RB_INVALID_COLOR;
     }
 
+	/* search order and links back from the children, duplicates of a
+	 * multiset may sit on either side */
+	if (root->key == NULL ||
+		(lo && (root->multi ? root->key < lo : root->key <= lo)) ||
+		(hi && (root->multi ? root->key > hi : root->key >= hi))) {
+		*violations &= ~RB_VALID;
+		*violations |= RB_UNORDERED_KEYS;
+	}
+	if ((root->left && root->left->parent != root) ||
+		(root->right && root->right->parent != root)) {
+		*violations &= ~RB_VALID;
+		*violations |= RB_BAD_PARENT;
+	}
+
 	if (IS_BLACK(root)) {
 		 /* if ndoe is not red, decrement black height */
 		(*black_h)--;
@@ -276,14 +735,150 @@ rb_validate_tree_recursive(node_t *root, rb_validation_t *violations, int *black
 	
     /* save current black_h since we need same value for both paths */
     int current_black_h = *black_h;
-    rb_validate_tree_recursive(root->left, violations, black_h);
+    rb_validate_tree_recursive(root->left, violations, black_h, lo, root->key);
     
     /* restore black_h for right path */
     *black_h = current_black_h;
-    rb_validate_tree_recursive(root->right, violations, black_h);
+    rb_validate_tree_recursive(root->right, violations, black_h, root->key, hi);
 	
 }
 
+/* only the RB_DEBUG checks print what validation found */
+#ifdef RB_DEBUG
+static void
+rb_report_violations(rb_validation_t violations)
+{
+	if (violations == RB_VALID) {
+		printf("tree is a valid rb tree\n");
+		return;
+	}
+
+	printf("tree validation failed.\n");
+
+	/* Check each violation flag */
+	if (violations & RB_RED_ROOT) {
+		printf("- root is red (violates property 2)\n");
+	}
+
+	if (violations & RB_RED_CHILD_OF_RED) {
+		printf("- found red node with red child (violates properties 4/7)\n");
+	}
+
+	if (violations & RB_UNEQUAL_BLACK_PATHS) {
+		printf("- paths have different number of black nodes (violates "
+			   "property 5)\n");
+	}
+
+	if (violations & RB_INVALID_COLOR) {
+		printf("- found node with invalid color (violates property 1)\n");
+	}
+
+	if (violations & RB_UNORDERED_KEYS) {
+		printf("- keys out of search order\n");
+	}
+
+	if (violations & RB_BAD_PARENT) {
+		printf("- parent pointer does not match the tree\n");
+	}
+
+	if (violations & RB_BAD_RUN) {
+		printf("- multiset run length does not match its duplicates\n");
+	}
+
+	if (violations & RB_NULL_NOT_BLACK) {
+		printf("- found null leaf that isn't black (violates property 3)\n");
+	}
+}
+#endif
+
+rb_validation_t
+validate_tree(node_t *root)
+{
+	rb_validation_t violations;
+
+	rb_validate_tree(root, &violations);
+	return violations;
+}
+
+/* one pass over the tree through the parent pointers, no stack. the black
+ * count of every NULL leaf is taken, so unlike rb_get_black_height this also
+ * shows how far an invalid tree is off */
+void
+tree_shape(node_t *root, rb_shape_t *out)
+{
+	node_t	*n = root, *prev = NULL;
+	uint32_t depth = 1, black = root && IS_BLACK(root);
+	uint64_t depth_sum = 0;
+
+	memset(out, 0, sizeof(*out));
+	out->black_height_min = UINT32_MAX;
+
+	while (n) {
+		if (prev == n->parent) {
+			/* first visit */
+			out->nodes++;
+			out->red_nodes += IS_RED(n);
+			out->depth_hist[depth <= RB_SHAPE_MAX_DEPTH ? depth - 1
+														: RB_SHAPE_MAX_DEPTH - 1]++;
+			depth_sum += depth;
+			if (depth > out->height) out->height = depth;
+
+			for (int leaf = (n->left == NULL) + (n->right == NULL); leaf > 0;
+				 leaf--) {
+				if (black < out->black_height_min) out->black_height_min = black;
+				if (black > out->black_height_max) out->black_height_max = black;
+			}
+			if (n->left || n->right) {
+				prev = n;
+				n	 = n->left ? n->left : n->right;
+				depth++;
+				black += IS_BLACK(n);
+				continue;
+			}
+		} else if (prev == n->left && n->right) {
+			prev = n;
+			n	 = n->right;
+			depth++;
+			black += IS_BLACK(n);
+			continue;
+		}
+
+		/* done with n and its subtrees */
+		black -= IS_BLACK(n);
+		depth--;
+		prev = n;
+		n	 = n->parent;
+	}
+
+	if (out->nodes == 0) out->black_height_min = 0;
+	if (out->nodes > 0) {
+		out->avg_depth = (double)depth_sum / out->nodes;
+		out->red_ratio = (double)out->red_nodes / out->nodes;
+	}
+	out->height_bound = 2 * log2((double)out->nodes + 1);
+}
+
+int
+write_shape_json(const rb_shape_t *shape, FILE *fp)
+{
+	uint32_t levels = shape->height < RB_SHAPE_MAX_DEPTH ? shape->height
+														 : RB_SHAPE_MAX_DEPTH;
+
+	fprintf(fp,
+			"{\"nodes\": %llu, \"height\": %u, \"height_bound\": %.2f, "
+			"\"black_height_min\": %u, \"black_height_max\": %u, "
+			"\"avg_depth\": %.3f, \"red_nodes\": %llu, \"red_ratio\": %.4f, "
+			"\"depth_hist\": [",
+			(unsigned long long)shape->nodes, shape->height, shape->height_bound,
+			shape->black_height_min, shape->black_height_max, shape->avg_depth,
+			(unsigned long long)shape->red_nodes, shape->red_ratio);
+	for (uint32_t i = 0; i < levels; i++)
+		fprintf(fp, "%s%llu", i ? ", " : "",
+				(unsigned long long)shape->depth_hist[i]);
+	fprintf(fp, "]}");
+	return ferror(fp) ? -1 : 0;
+}
+
 /* returns the color of the aunt,
    the return value determines what fix is needed */
 static color_t
@@ -299,23 +894,1314 @@ rb_get_uncle_color(node_t *n)
 	return grandparent->left == NULL ? BLACK : grandparent->left->color;
 }
 
+/* the grandparent takes the red from its two children, used when the aunt of
+ * a red-red pair is red */
 static void
 rb_color_flip(node_t *root)
 {
+	RB_STAT_ADD(color_flips, 1);
+	root->color		   = RED;
+	root->left->color  = BLACK;
+	root->right->color = BLACK;
 }
+
+/* rotates around node, LEFT moves node->right up into node's place and RIGHT
+ * moves node->left up. the parent of node is fixed, the root pointer is not */
 static void
 rb_rotate(node_t *node, rotation_t dir)
 {
+	node_t *pivot = dir == LEFT ? node->right : node->left;
+
+	if (dir == LEFT)
+		RB_STAT_ADD(rotations_left, 1);
+	else
+		RB_STAT_ADD(rotations_right, 1);
+	RB_TRACE_ROTATION();
+
+	if (dir == LEFT) {
+		node->right = pivot->left;
+		if (pivot->left) pivot->left->parent = node;
+		pivot->left = node;
+	} else {
+		node->left = pivot->right;
+		if (pivot->right) pivot->right->parent = node;
+		pivot->right = node;
+	}
+
+	pivot->parent = node->parent;
+	if (node->parent) {
+		if (node->parent->left == node)
+			node->parent->left = pivot;
+		else
+			node->parent->right = pivot;
+	}
+	node->parent = pivot;
+}
+
+/* fixes a red node that may have a red parent, walking up the tree.
+ * returns true if the root had to be blackened, which grows the black height
+ * of the tree by one */
+static bool
+rb_rebalance(node_t *node)
+{
+	while (node->parent && IS_RED(node->parent)) {
+		/* a red parent is never the root, so the grandparent exists */
+		node_t *parent		= node->parent;
+		node_t *grandparent = parent->parent;
+
+		if (rb_get_uncle_color(node) == RED) {
+			rb_color_flip(grandparent);
+			node = grandparent;
+			continue;
+		}
+
+		/* black aunt: line the node up with its parent, then rotate around
+		 * the grandparent */
+		if (parent == grandparent->left) {
+			if (node == parent->right) {
+				rb_rotate(parent, LEFT);
+				parent = node;
+			}
+			rb_rotate(grandparent, RIGHT);
+		} else {
+			if (node == parent->left) {
+				rb_rotate(parent, RIGHT);
+				parent = node;
+			}
+			rb_rotate(grandparent, LEFT);
+		}
+		parent->color	   = BLACK;
+		grandparent->color = RED;
+		return false;
+	}
+
+	if (node->parent == NULL && IS_RED(node)) {
+		node->color = BLACK;
+		return true;
+	}
+	return false;
+}
+
+/* puts child in place of n under n's parent */
+static void
+rb_transplant(node_t **root, node_t *n, node_t *child)
+{
+	if (n->parent == NULL)
+		*root = child;
+	else if (n == n->parent->left)
+		n->parent->left = child;
+	else
+		n->parent->right = child;
+	if (child) child->parent = n->parent;
 }
 
+/* rb_rotate and keep the root pointer up to date */
 static void
-rb_rebalance(node_t *node)
+rb_rotate_root(node_t **root, node_t *node, rotation_t dir)
 {
-	color_t c = rb_get_uncle_color(node);
-	if (c == -1) return;
-	if (c == RED) {
-		rb_color_flip(node);
-		return;
+	rb_rotate(node, dir);
+	if (node == *root) *root = node->parent;
+}
+
+/* unlinks z from the tree, its successor takes its place when it has two
+ * children. nodes are relinked rather than having keys copied, so pointers to
+ * the other nodes stay valid */
+static void
+rb_delete_node(node_t **root, node_t *z)
+{
+	node_t *x, *xparent;
+	color_t removed = z->color;
+
+	if (z->left == NULL || z->right == NULL) {
+		x		= z->left ? z->left : z->right;
+		xparent = z->parent;
+		rb_transplant(root, z, x);
+	} else {
+		node_t *y = z->right;
+		while (y->left) y = y->left;
+
+		removed = y->color;
+		x		= y->right;
+		if (y->parent == z) {
+			xparent = y;
+		} else {
+			xparent = y->parent;
+			rb_transplant(root, y, y->right);
+			y->right		 = z->right;
+			y->right->parent = y;
+		}
+		rb_transplant(root, z, y);
+		y->left			= z->left;
+		y->left->parent = y;
+		y->color		= z->color;
 	}
-	rb_rotate(node->parent, LEFT);
-}
\ No newline at end of file
+	z->parent = z->left = z->right = NULL;
+
+	/* removing a red node never changes a black height */
+	if (removed == BLACK) rb_delete_fixup(root, x, xparent);
+}
+
+/* removes n from the tree and frees it. a multiset run keeps its length on
+ * its last node: n hands it to its predecessor if it is the last one,
+ * otherwise the last one is found with a descent */
+static void
+rb_erase(node_t **root, node_t *n)
+{
+	RB_STAT_ADD(deletes, 1);
+	if (n->multi) {
+		rb_multi_t *m = (rb_multi_t *)n;
+		if (m->run == 0)
+			((rb_multi_t *)rb_floor(*root, n->key))->run--;
+		else if (m->run > 1)
+			((rb_multi_t *)prev_node(n))->run = m->run - 1;
+	}
+	rb_delete_node(root, n);
+	if (!n->pooled) free(n);
+
+#ifdef RB_DEBUG
+	rb_validation_t violations = RB_VALID;
+	rb_validate_tree(*root, &violations);
+	rb_report_violations(violations);
+#endif
+}
+
+/* x (possibly NULL) sits on a path that lost one black node. push the extra
+ * black up until it lands on a red node or the root, or fix it with rotations
+ * around the sibling */
+static void
+rb_delete_fixup(node_t **root, node_t *x, node_t *xparent)
+{
+	while (x != *root && (x == NULL || IS_BLACK(x))) {
+		/* the sibling exists, its side has one more black node than x */
+		bool	   left = x == xparent->left;
+		node_t	  *w	= left ? xparent->right : xparent->left;
+		rotation_t dir	= left ? LEFT : RIGHT;
+
+		if (IS_RED(w)) {
+			w->color	   = BLACK;
+			xparent->color = RED;
+			rb_rotate_root(root, xparent, dir);
+			w = left ? xparent->right : xparent->left;
+		}
+
+		node_t *near = left ? w->left : w->right;
+		node_t *far	 = left ? w->right : w->left;
+
+		if ((near == NULL || IS_BLACK(near)) && (far == NULL || IS_BLACK(far))) {
+			w->color = RED;
+			x		 = xparent;
+			xparent	 = x->parent;
+			continue;
+		}
+
+		if (far == NULL || IS_BLACK(far)) {
+			near->color = BLACK;
+			w->color	= RED;
+			rb_rotate_root(root, w, left ? RIGHT : LEFT);
+			w	= left ? xparent->right : xparent->left;
+			far = left ? w->right : w->left;
+		}
+		w->color	   = xparent->color;
+		xparent->color = BLACK;
+		far->color	   = BLACK;
+		rb_rotate_root(root, xparent, dir);
+		x = *root;
+	}
+	if (x) x->color = BLACK;
+}
+
+/* bulk build
+ * the keys are sorted with a parallel merge sort, deduplicated, then the tree
+ * is built top-down by always picking the middle key as subtree root. the
+ * subtrees of a node are disjoint ranges of the sorted array, so they can be
+ * built on different threads without any locking.
+ *
+ * nodes are laid out in preorder: a subtree over keys[lo, hi) placed at slot s
+ * has its root at s, its left subtree at s + 1 and its right subtree right
+ * after the left one, at s + 1 + (mid - lo). every job writes to its own
+ * slice of the node array.
+ *
+ * coloring: a middle-split tree has all its NULL leaves on the last two levels,
+ * so every level but the last one is full. all nodes are black, except the ones
+ * on an incomplete last level which are red. every path then has the same
+ * number of black nodes and red nodes only have NULL children.
+ */
+
+/* subtrees smaller than this are never handed to another thread */
+#define RB_BULK_SPAWN_MIN (1 << 16)
+
+typedef struct {
+	void  **keys;
+	void  **tmp;
+	size_t	n;
+	int		spawn;
+} rb_sort_job_t;
+
+/* number of recursion levels that hand work to a new thread, 0 threads means
+ * one per online cpu */
+static int
+rb_spawn_levels(unsigned nthreads)
+{
+	if (nthreads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads  = cpus > 0 ? (unsigned)cpus : 1;
+	}
+
+	int spawn = 0;
+	while ((1u << spawn) < nthreads) spawn++;
+	return spawn;
+}
+
+typedef struct {
+	const rb_build_ctx_t *ctx;
+	size_t				  lo, hi, slot;
+	node_t				 *parent;
+	int					  depth, spawn;
+	node_t				 *out;
+} rb_build_job_t;
+
+/* keys are ordered by address, same as rb_insert_node */
+static int
+rb_key_cmp(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t) * (void *const *)a;
+	uintptr_t y = (uintptr_t) * (void *const *)b;
+	return (x > y) - (x < y);
+}
+
+static void *
+rb_sort_worker(void *arg)
+{
+	rb_sort_job_t *job = arg;
+	rb_sort_keys(job->keys, job->tmp, job->n, job->spawn);
+	return NULL;
+}
+
+/* sorts keys[0, n), tmp must hold n entries. the left half is sorted on a new
+ * thread while this one sorts the right half, for spawn levels */
+static void
+rb_sort_keys(void **keys, void **tmp, size_t n, int spawn)
+{
+	if (spawn <= 0 || n < RB_BULK_SPAWN_MIN) {
+		qsort(keys, n, sizeof(void *), rb_key_cmp);
+		return;
+	}
+
+	size_t		  half = n / 2;
+	rb_sort_job_t left = {keys, tmp, half, spawn - 1};
+	pthread_t	  tid;
+	bool		  spawned = pthread_create(&tid, NULL, rb_sort_worker, &left) == 0;
+
+	if (!spawned) rb_sort_worker(&left);
+	rb_sort_keys(keys + half, tmp + half, n - half, spawn - 1);
+	if (spawned) pthread_join(tid, NULL);
+
+	/* merge both halves into tmp, then copy back */
+	size_t i = 0, j = half, k = 0;
+	while (i < half && j < n) {
+		if ((uintptr_t)keys[j] < (uintptr_t)keys[i])
+			tmp[k++] = keys[j++];
+		else
+			tmp[k++] = keys[i++];
+	}
+	while (i < half) tmp[k++] = keys[i++];
+	while (j < n) tmp[k++] = keys[j++];
+	memcpy(keys, tmp, n * sizeof(void *));
+}
+
+static void *
+rb_build_worker(void *arg)
+{
+	rb_build_job_t *job = arg;
+	job->out = rb_build_subtree(job->ctx, job->lo, job->hi, job->slot,
+								job->parent, job->depth, job->spawn);
+	return NULL;
+}
+
+/* builds the subtree over keys[lo, hi) at nodes[slot], returns its root */
+static node_t *
+rb_build_subtree(const rb_build_ctx_t *ctx, size_t lo, size_t hi, size_t slot,
+				 node_t *parent, int depth, int spawn)
+{
+	if (lo >= hi) return NULL;
+
+	size_t	mid = lo + (hi - lo) / 2;
+	node_t *n	= &ctx->nodes[slot];
+
+	n->key	  = ctx->keys[mid];
+	n->parent = parent;
+	n->pooled	 = true;
+	n->has_value = false;
+	n->multi	 = false;
+	n->color  = depth == ctx->red_depth ? RED : BLACK;
+
+	rb_build_job_t left = {ctx, lo, mid, slot + 1, n, depth + 1, spawn - 1, NULL};
+	pthread_t	   tid;
+	bool		   spawned = false;
+
+	if (spawn > 0 && hi - lo >= RB_BULK_SPAWN_MIN)
+		spawned = pthread_create(&tid, NULL, rb_build_worker, &left) == 0;
+	if (!spawned) rb_build_worker(&left);
+
+	n->right = rb_build_subtree(ctx, mid + 1, hi, slot + 1 + (mid - lo), n,
+								depth + 1, spawn - 1);
+	if (spawned) pthread_join(tid, NULL);
+	n->left = left.out;
+
+	return n;
+}
+
+node_t *
+build_tree(void **keys, size_t n, unsigned nthreads, node_t **block)
+{
+	*block = NULL;
+	if (keys == NULL || n == 0) return NULL;
+
+	int spawn = rb_spawn_levels(nthreads);
+
+	void **tmp = malloc(n * sizeof(void *));
+	if (tmp == NULL) return NULL;
+	rb_sort_keys(keys, tmp, n, spawn);
+	free(tmp);
+
+	/* drop duplicates and NULL keys, create_node refuses those too */
+	size_t count = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (keys[i] == NULL) continue;
+		if (count > 0 && keys[count - 1] == keys[i]) continue;
+		keys[count++] = keys[i];
+	}
+	if (count == 0) return NULL;
+
+	node_t *nodes = malloc(count * sizeof(node_t));
+	if (nodes == NULL) return NULL;
+
+	/* depth of the deepest level, it gets red nodes unless it is full */
+	int height = 0;
+	while ((count >> (height + 1)) != 0) height++;
+
+	rb_build_ctx_t ctx = {keys, nodes, (count & (count + 1)) ? height : -1};
+	node_t		  *root = rb_build_subtree(&ctx, 0, count, 0, NULL, 0, spawn);
+
+#ifndef NDEBUG
+	rb_validation_t violations = RB_VALID;
+	rb_validate_tree(root, &violations);
+	assert(violations == RB_VALID);
+#endif
+
+	*block = nodes;
+	return root;
+}
+
+/* van emde boas compaction
+ * the tree is copied into one block in van emde boas order: a subtree of
+ * height h is cut at half its height, the top half is laid out first and each
+ * of the subtrees hanging below it follows in turn, every part recursively
+ * the same way. whatever the cache line or page size, a descent then reads
+ * O(log_B n) contiguous runs of the block instead of one scattered node per
+ * level.
+ *
+ * the source tree is only read. a copy is linked to its parent when the
+ * parent's part of the layout is done: the children hanging below a top part
+ * are collected as hooks (source child, copied parent, side) on a stack, each
+ * bottom part is laid out from its hook and linked, and what the bottom parts
+ * leave hanging replaces the top part's hooks on the stack.
+ */
+
+typedef struct {
+	node_t *child;	/* source subtree still to lay out */
+	node_t *parent; /* copy it hangs from */
+	bool	right;
+} rb_veb_hook_t;
+
+typedef struct {
+	char		  *slots; /* the block */
+	size_t		   slot;  /* bytes per node, the largest kind in the tree */
+	size_t		   used;
+	rb_veb_hook_t *hooks;
+	size_t		   nhooks;
+	size_t		   cap;
+	bool		   failed;
+} rb_veb_t;
+
+static void
+rb_veb_hook(rb_veb_t *v, node_t *child, node_t *parent, bool right)
+{
+	if (child == NULL || v->failed) return;
+	if (v->nhooks == v->cap) {
+		size_t		   cap	 = v->cap ? v->cap * 2 : 64;
+		rb_veb_hook_t *hooks = realloc(v->hooks, cap * sizeof(*hooks));
+		if (hooks == NULL) {
+			v->failed = true;
+			return;
+		}
+		v->hooks = hooks;
+		v->cap	 = cap;
+	}
+	v->hooks[v->nhooks++] = (rb_veb_hook_t){child, parent, right};
+}
+
+/* lays out the top h levels of the subtree at n, returns the copy of n. the
+ * children below those levels are pushed as hooks */
+static node_t *
+rb_veb_layout(rb_veb_t *v, node_t *n, unsigned h)
+{
+	if (h == 1) {
+		node_t *c = (node_t *)(v->slots + v->used++ * v->slot);
+		memcpy(c, n, n->multi ? sizeof(rb_multi_t)
+				   : n->has_value ? sizeof(rb_pair_t)
+								  : sizeof(node_t));
+		c->parent = c->left = c->right = NULL;
+		c->pooled = true;
+		rb_veb_hook(v, n->left, c, false);
+		rb_veb_hook(v, n->right, c, true);
+		return c;
+	}
+
+	unsigned top = h / 2;
+	size_t	 mark = v->nhooks;
+	node_t	*copy = rb_veb_layout(v, n, top);
+	size_t	 end  = v->nhooks;
+
+	for (size_t i = mark; i < end && !v->failed; i++) {
+		rb_veb_hook_t hook = v->hooks[i];
+		node_t		 *c	   = rb_veb_layout(v, hook.child, h - top);
+		c->parent		   = hook.parent;
+		if (hook.right)
+			hook.parent->right = c;
+		else
+			hook.parent->left = c;
+	}
+	/* the top part's hooks are done, the bottom parts' ones take their place */
+	memmove(v->hooks + mark, v->hooks + end,
+			(v->nhooks - end) * sizeof(*v->hooks));
+	v->nhooks -= end - mark;
+	return copy;
+}
+
+/* nodes, height and the largest node kind of a tree */
+static unsigned
+rb_veb_measure(node_t *n, size_t *count, size_t *slot)
+{
+	if (n == NULL) return 0;
+
+	size_t size = n->multi ? sizeof(rb_multi_t)
+				: n->has_value ? sizeof(rb_pair_t)
+							   : sizeof(node_t);
+	if (size > *slot) *slot = size;
+	(*count)++;
+
+	unsigned l = rb_veb_measure(n->left, count, slot);
+	unsigned r = rb_veb_measure(n->right, count, slot);
+	return 1 + (l > r ? l : r);
+}
+
+node_t *
+compact_tree(node_t *root, node_t **block)
+{
+	rb_veb_t v;
+	size_t	 count = 0;
+
+	*block = NULL;
+	memset(&v, 0, sizeof(v));
+	unsigned height = rb_veb_measure(root, &count, &v.slot);
+	if (count == 0) return NULL;
+
+	/* line aligned, so the layout's runs start on line boundaries */
+	size_t bytes = (count * v.slot + 63) & ~(size_t)63;
+	v.slots		 = aligned_alloc(64, bytes);
+	if (v.slots == NULL) return NULL;
+
+	node_t *copy = rb_veb_layout(&v, root, height);
+	free(v.hooks);
+	if (v.failed) {
+		free(v.slots);
+		return NULL;
+	}
+	assert(v.used == count && v.nhooks == 0);
+
+	*block = (node_t *)v.slots;
+	return copy;
+}
+
+/* join and split
+ * join(l, k, r) links two trees around a middle node k, every key of l being
+ * smaller than k and every key of r larger. when both black heights match, k
+ * simply becomes the new black root. otherwise k walks down the spine of the
+ * taller tree until it finds a black node of the same black height as the
+ * shorter tree, takes its place as a red node, and rb_rebalance fixes any red
+ * pair on the way up. the cost is O(|bh(l) - bh(r)| + 1).
+ *
+ * split(t, key) goes down the search path of key and joins the subtrees it
+ * leaves behind into a left and a right tree, O(log n) overall since the
+ * black heights being joined keep growing.
+ *
+ * union, intersection and difference follow Blelloch et al., "Just Join for
+ * Parallel Ordered Sets": split the second tree by the root of the first,
+ * recurse on both sides, join back. the two recursive calls share no node so
+ * they run on separate threads near the top of the recursion.
+ */
+
+/* trees with a black height below this are too small for a thread */
+#define RB_SETOP_SPAWN_BH 12
+
+typedef struct {
+	rb_setop_t op;
+	rb_sub_t   a, b;
+	int		   spawn;
+	rb_batch_t dropped;
+	rb_sub_t   out;
+} rb_setop_job_t;
+
+static rb_sub_t
+rb_sub(node_t *root)
+{
+	rb_sub_t t = {root, root ? rb_get_black_height(root) : 0};
+	return t;
+}
+
+/* cuts a child subtree loose, bh is its black height as part of the tree */
+static rb_sub_t
+rb_detach(node_t *child, int bh)
+{
+	rb_sub_t t = {child, bh};
+	if (child == NULL) return t;
+
+	child->parent = NULL;
+	if (IS_RED(child)) {
+		child->color = BLACK;
+		t.bh++;
+	}
+	return t;
+}
+
+static void
+rb_batch_push(rb_batch_t *b, node_t *n)
+{
+	n->parent = n->left = n->right = NULL;
+	if (b->tail)
+		b->tail->right = n;
+	else
+		b->head = n;
+	b->tail = n;
+}
+
+/* drops every node of a subtree, rotating left children up so no stack is
+ * needed */
+static void
+rb_batch_push_tree(rb_batch_t *b, node_t *root)
+{
+	while (root) {
+		if (root->left) {
+			node_t *l  = root->left;
+			root->left = l->right;
+			l->right   = root;
+			root	   = l;
+			continue;
+		}
+		node_t *next = root->right;
+		rb_batch_push(b, root);
+		root = next;
+	}
+}
+
+static void
+rb_batch_concat(rb_batch_t *b, rb_batch_t *other)
+{
+	if (other->head == NULL) return;
+	if (b->tail)
+		b->tail->right = other->head;
+	else
+		b->head = other->head;
+	b->tail = other->tail;
+}
+
+static rb_sub_t
+rb_join(rb_sub_t l, node_t *k, rb_sub_t r)
+{
+	k->parent = NULL;
+
+	if (l.bh == r.bh) {
+		k->left	 = l.root;
+		k->right = r.root;
+		k->color = BLACK;
+		if (l.root) l.root->parent = k;
+		if (r.root) r.root->parent = k;
+		rb_sub_t t = {k, l.bh + 1};
+		return t;
+	}
+
+	/* walk down the inner spine of the taller tree */
+	bool	taller_left = l.bh > r.bh;
+	node_t *t			= taller_left ? l.root : r.root;
+	node_t *p			= NULL;
+	int		h			= taller_left ? l.bh : r.bh;
+	int		target		= taller_left ? r.bh : l.bh;
+
+	while (t && !(IS_BLACK(t) && h == target)) {
+		if (IS_BLACK(t)) h--;
+		p = t;
+		t = taller_left ? t->right : t->left;
+	}
+
+	/* p exists, the taller tree has a black node above the target height */
+	k->color  = RED;
+	k->parent = p;
+	if (taller_left) {
+		k->left	 = t;
+		k->right = r.root;
+		p->right = k;
+	} else {
+		k->left	 = l.root;
+		k->right = t;
+		p->left	 = k;
+	}
+	if (k->left) k->left->parent = k;
+	if (k->right) k->right->parent = k;
+
+	rb_sub_t out = taller_left ? l : r;
+	out.bh += rb_rebalance(k);
+	while (out.root->parent) out.root = out.root->parent;
+	return out;
+}
+
+/* detaches the largest node of t */
+static rb_sub_t
+rb_split_last(rb_sub_t t, node_t **last)
+{
+	node_t	*n	= t.root;
+	int		 bh = t.bh - IS_BLACK(n);
+	rb_sub_t l	= rb_detach(n->left, bh);
+
+	if (n->right == NULL) {
+		*last = n;
+		return l;
+	}
+
+	rb_sub_t rest = rb_split_last(rb_detach(n->right, bh), last);
+	return rb_join(l, n, rest);
+}
+
+/* joins two trees without a middle node, the largest node of l is used */
+static rb_sub_t
+rb_join2(rb_sub_t l, rb_sub_t r)
+{
+	if (l.root == NULL) return r;
+	if (r.root == NULL) return l;
+
+	node_t	*k;
+	rb_sub_t rest = rb_split_last(l, &k);
+	return rb_join(rest, k, r);
+}
+
+/* splits t into keys smaller and larger than key, returns the node holding key
+ * detached from both trees, or NULL */
+static node_t *
+rb_split(rb_sub_t t, void *key, rb_sub_t *l, rb_sub_t *r)
+{
+	if (t.root == NULL) {
+		*l = *r = t;
+		return NULL;
+	}
+
+	node_t	*n	= t.root;
+	int		 bh = t.bh - IS_BLACK(n);
+	rb_sub_t nl = rb_detach(n->left, bh);
+	rb_sub_t nr = rb_detach(n->right, bh);
+	rb_sub_t rest;
+	node_t	*found;
+
+	if (key == n->key) {
+		*l		 = nl;
+		*r		 = nr;
+		n->left	 = n->right = NULL;
+		n->color = BLACK;
+		return n;
+	}
+	if (key < n->key) {
+		found = rb_split(nl, key, l, &rest);
+		*r	  = rb_join(rest, n, nr);
+	} else {
+		found = rb_split(nr, key, &rest, r);
+		*l	  = rb_join(nl, n, rest);
+	}
+	return found;
+}
+
+static void *
+rb_setop_worker(void *arg)
+{
+	rb_setop_job_t *job = arg;
+	job->out = rb_setop(job->op, job->a, job->b, job->spawn, &job->dropped);
+	return NULL;
+}
+
+/* a and b are consumed, nodes that do not make it into the result are
+ * appended to dropped */
+static rb_sub_t
+rb_setop(rb_setop_t op, rb_sub_t a, rb_sub_t b, int spawn, rb_batch_t *dropped)
+{
+	rb_sub_t empty = {NULL, 0};
+
+	if (a.root == NULL) {
+		if (op == RB_UNION) return b;
+		rb_batch_push_tree(dropped, b.root);
+		return empty;
+	}
+	if (b.root == NULL) {
+		if (op != RB_INTERSECTION) return a;
+		rb_batch_push_tree(dropped, a.root);
+		return empty;
+	}
+
+	/* difference splits a by the root of b, the others split b by the root
+	 * of a, the root used as pivot is n and the other tree is split */
+	node_t	*n	   = op == RB_DIFFERENCE ? b.root : a.root;
+	rb_sub_t pivot = op == RB_DIFFERENCE ? b : a;
+	rb_sub_t other = op == RB_DIFFERENCE ? a : b;
+	int		 bh	   = pivot.bh - IS_BLACK(n);
+	rb_sub_t pl	   = rb_detach(n->left, bh);
+	rb_sub_t pr	   = rb_detach(n->right, bh);
+	rb_sub_t sl, sr;
+	node_t	*match = rb_split(other, n->key, &sl, &sr);
+
+	rb_setop_job_t left = {op,
+						   op == RB_DIFFERENCE ? sl : pl,
+						   op == RB_DIFFERENCE ? pl : sl,
+						   spawn - 1,
+						   {NULL, NULL},
+						   empty};
+	pthread_t	   tid;
+	bool		   spawned = false;
+
+	if (spawn > 0 && pivot.bh >= RB_SETOP_SPAWN_BH)
+		spawned = pthread_create(&tid, NULL, rb_setop_worker, &left) == 0;
+	if (!spawned) rb_setop_worker(&left);
+
+	rb_sub_t right = op == RB_DIFFERENCE
+						 ? rb_setop(op, sr, pr, spawn - 1, dropped)
+						 : rb_setop(op, pr, sr, spawn - 1, dropped);
+	if (spawned) pthread_join(tid, NULL);
+	rb_batch_concat(dropped, &left.dropped);
+
+	switch (op) {
+	case RB_UNION:
+		if (match) rb_batch_push(dropped, match);
+		return rb_join(left.out, n, right);
+	case RB_INTERSECTION:
+		if (match) {
+			rb_batch_push(dropped, match);
+			return rb_join(left.out, n, right);
+		}
+		rb_batch_push(dropped, n);
+		return rb_join2(left.out, right);
+	case RB_DIFFERENCE:
+		rb_batch_push(dropped, n);
+		if (match) rb_batch_push(dropped, match);
+		return rb_join2(left.out, right);
+	}
+	return empty;
+}
+
+static node_t *
+rb_setop_trees(rb_setop_t op, node_t *a, node_t *b, unsigned nthreads,
+			   node_t **dropped)
+{
+	rb_batch_t batch = {NULL, NULL};
+	rb_sub_t   t = rb_setop(op, rb_sub(a), rb_sub(b), rb_spawn_levels(nthreads),
+							&batch);
+
+	if (dropped)
+		*dropped = batch.head;
+	else
+		free_nodes(batch.head);
+	return t.root;
+}
+
+node_t *
+join_trees(node_t *left, node_t *right)
+{
+	return rb_join2(rb_sub(left), rb_sub(right)).root;
+}
+
+node_t *
+split_tree(node_t *root, void *key, node_t **left, node_t **right)
+{
+	rb_sub_t l, r;
+	node_t	*found = rb_split(rb_sub(root), key, &l, &r);
+
+	*left  = l.root;
+	*right = r.root;
+	return found;
+}
+
+node_t *
+union_trees(node_t *a, node_t *b, unsigned nthreads, node_t **dropped)
+{
+	return rb_setop_trees(RB_UNION, a, b, nthreads, dropped);
+}
+
+node_t *
+intersect_trees(node_t *a, node_t *b, unsigned nthreads, node_t **dropped)
+{
+	return rb_setop_trees(RB_INTERSECTION, a, b, nthreads, dropped);
+}
+
+node_t *
+difference_trees(node_t *a, node_t *b, unsigned nthreads, node_t **dropped)
+{
+	return rb_setop_trees(RB_DIFFERENCE, a, b, nthreads, dropped);
+}
+
+node_t *
+detach_range(node_t **root, void *lo, void *hi)
+{
+	rb_sub_t empty = {NULL, 0};
+	rb_sub_t below, rest, range, above;
+
+	/* the splits keep one node per key, duplicates would be cut apart */
+	if (*root == NULL || (*root)->multi || (uintptr_t)lo >= (uintptr_t)hi)
+		return NULL;
+
+	/* lo belongs to the range, hi stays in the tree */
+	node_t *first = rb_split(rb_sub(*root), lo, &below, &rest);
+	node_t *end	  = rb_split(rest, hi, &range, &above);
+
+	if (first) range = rb_join(empty, first, range);
+	*root = end ? rb_join(below, end, above).root
+				: rb_join2(below, above).root;
+	return range.root;
+}
+
+node_t *
+erase_range(node_t **root, void *lo, void *hi)
+{
+	rb_batch_t batch = {NULL, NULL};
+	rb_batch_push_tree(&batch, detach_range(root, lo, hi));
+	return batch.head;
+}
+
+static void *
+rb_free_worker(void *arg)
+{
+	free_tree(arg);
+	return NULL;
+}
+
+static void *
+rb_free_nodes_worker(void *arg)
+{
+	free_nodes(arg);
+	return NULL;
+}
+
+void
+free_tree(node_t *root)
+{
+	rb_batch_t batch = {NULL, NULL};
+	rb_batch_push_tree(&batch, root);
+	free_nodes(batch.head);
+}
+
+void
+free_tree_async(node_t *root)
+{
+	pthread_t tid;
+
+	if (root == NULL) return;
+	if (pthread_create(&tid, NULL, rb_free_worker, root) != 0) {
+		free_tree(root);
+		return;
+	}
+	pthread_detach(tid);
+}
+
+void
+free_nodes(node_t *list)
+{
+	while (list) {
+		node_t *next = list->right;
+		if (!list->pooled) free(list);
+		list = next;
+	}
+}
+
+void
+free_nodes_async(node_t *list)
+{
+	pthread_t tid;
+
+	if (list == NULL) return;
+	if (pthread_create(&tid, NULL, rb_free_nodes_worker, list) != 0) {
+		free_nodes(list);
+		return;
+	}
+	pthread_detach(tid);
+}
+
+/* tree handle */
+
+/* the handle frees the block with the tree */
+static bool
+rb_tree_adopt(rbtree_t *t, node_t *block)
+{
+	if (block == NULL) return true;
+
+	node_t **blocks = realloc(t->blocks, (t->nblocks + 1) * sizeof(*blocks));
+	if (blocks == NULL) return false;
+	blocks[t->nblocks++] = block;
+	t->blocks			 = blocks;
+	return true;
+}
+
+rbtree_t *
+create_tree(node_t *root, node_t *block)
+{
+	rbtree_t *t = calloc(1, sizeof(*t));
+	if (t == NULL) return NULL;
+
+	if (!rb_tree_adopt(t, block)) {
+		free(t);
+		return NULL;
+	}
+	t->root = root;
+	return t;
+}
+
+void
+destroy_tree(rbtree_t *t)
+{
+	if (t == NULL) return;
+	rb_tree_settle(t);
+	free_tree(t->root);
+	for (size_t i = 0; i < t->nblocks; i++) free(t->blocks[i]);
+	free(t->blocks);
+	free(t->delta.entries);
+	free_frozen(t->frozen);
+	free(t);
+}
+
+node_t *
+tree_root(const rbtree_t *t)
+{
+	return t->root;
+}
+
+/* appends a mutation to the delta log, grows it by doubling. when the log
+ * cannot grow it stops recording and the next write_delta fails, the change
+ * itself stays */
+static void
+rb_delta_record(rbtree_t *t, void *key, rb_op_t op)
+{
+	rb_delta_t *d = &t->delta;
+
+	if (d->lost) return;
+	if (d->len == d->cap) {
+		size_t			  cap = d->cap ? d->cap * 2 : 1024;
+		rb_delta_entry_t *e	  = realloc(d->entries, cap * sizeof(*e));
+		if (e == NULL) {
+			d->lost = true;
+			return;
+		}
+		d->entries = e;
+		d->cap	   = cap;
+	}
+	d->entries[d->len].key = key;
+	d->entries[d->len].op  = op;
+	d->len++;
+}
+
+/* a mutation waits for a running compaction and takes its copy first */
+static void
+rb_tree_settle(rbtree_t *t)
+{
+	if (t->compacting) tree_compact_end(t);
+}
+
+/* drops the frozen snapshot, called on every change of the tree's shape */
+static void
+rb_tree_thaw(rbtree_t *t)
+{
+	free_frozen(t->frozen);
+	t->frozen = NULL;
+}
+
+/* every insert of the handle goes through here. in finger mode it starts at
+ * the node of the previous insert, or right at the first or last node for a
+ * key beyond it, which makes an ascending stream O(1) before rebalancing */
+static node_t *
+rb_tree_insert(rbtree_t *t, void *key, bool pair, void *value, bool *created)
+{
+	node_t *hint  = NULL;
+	bool	climb = true, c;
+
+	rb_tree_settle(t);
+	if (t->use_finger) {
+		hint = t->finger;
+		if (t->last && key > t->last->key)
+			hint = t->last, climb = false;
+		else if (t->first && key < t->first->key)
+			hint = t->first, climb = false;
+	}
+
+	RB_STATS_BEGIN(t);
+	node_t *n = rb_insert_at(&t->root, hint, climb, key, pair, value, &c);
+	RB_STATS_END();
+
+	if (t->use_finger && n) {
+		t->finger = n;
+		if (t->first == NULL || key < t->first->key) t->first = n;
+		if (t->last == NULL || key > t->last->key) t->last = n;
+	}
+	if (c) rb_tree_thaw(t);
+	if (c && t->track) rb_delta_record(t, key, RB_OP_INSERT);
+	if (created) *created = c;
+	return n;
+}
+
+
+/* finger, first and last after the tree changed wholesale */
+static void
+rb_tree_refinger(rbtree_t *t)
+{
+	node_t *last = t->root;
+
+	t->finger = NULL;
+	t->first  = NULL;
+	t->last	  = NULL;
+	if (!t->use_finger || last == NULL) return;
+	while (last->right) last = last->right;
+	t->first = first_node(t->root);
+	t->last	 = last;
+}
+
+bool
+tree_insert(rbtree_t *t, void *key)
+{
+	bool inserted;
+
+	rb_tree_insert(t, key, false, NULL, &inserted);
+	return inserted;
+}
+
+bool
+tree_insert_pair(rbtree_t *t, void *key, void *value)
+{
+	bool inserted;
+
+	rb_tree_insert(t, key, true, value, &inserted);
+	return inserted;
+}
+
+node_t *
+tree_insert_or_get(rbtree_t *t, void *key, bool *created)
+{
+	return rb_tree_insert(t, key, false, NULL, created);
+}
+
+node_t *
+tree_upsert(rbtree_t *t, void *key, void *value, bool *created)
+{
+	return rb_tree_insert(t, key, true, value, created);
+}
+
+void
+set_tree_finger(rbtree_t *t, bool on)
+{
+	t->use_finger = on;
+	rb_tree_refinger(t);
+}
+
+bool
+tree_delete(rbtree_t *t, void *key)
+{
+	rb_tree_settle(t);
+
+	/* nodes are relinked on delete, never moved, so only a pointer to the
+	 * deleted node itself goes stale. a neighbour takes over */
+	if (t->finger && t->finger->key == key) t->finger = prev_node(t->finger);
+	if (t->first && t->first->key == key) t->first = next_node(t->first);
+	if (t->last && t->last->key == key) t->last = prev_node(t->last);
+
+	RB_STATS_BEGIN(t);
+	bool deleted = delete_node(&t->root, key);
+	RB_STATS_END();
+
+	if (deleted) rb_tree_thaw(t);
+	if (deleted && t->track) rb_delta_record(t, key, RB_OP_DELETE);
+	return deleted;
+}
+
+node_t *
+tree_search(rbtree_t *t, void *key)
+{
+	node_t *n;
+
+	RB_STATS_BEGIN(t);
+	if (t->frozen) {
+		/* the snapshot compares whole blocks, only the lookup is counted */
+		RB_STAT_ADD(lookups, 1);
+		n = search_frozen(t->frozen, key);
+	} else {
+		n = search(t->root, key);
+	}
+	RB_STATS_END();
+	return n;
+}
+
+size_t
+tree_search_batch(rbtree_t *t, void **keys, size_t n, node_t **out)
+{
+	RB_STATS_BEGIN(t);
+	size_t found = search_batch(t->root, keys, n, out);
+	RB_STATS_END();
+	return found;
+}
+
+bool
+tree_stats(const rbtree_t *t, rb_stats_t *out)
+{
+#ifdef RB_STATS
+	*out = t->stats;
+	return true;
+#else
+	(void)t;
+	memset(out, 0, sizeof(*out));
+	return false;
+#endif
+}
+
+void
+reset_tree_stats(rbtree_t *t)
+{
+#ifdef RB_STATS
+	memset(&t->stats, 0, sizeof(t->stats));
+#else
+	(void)t;
+#endif
+}
+
+/* records the keys of a freshly built tree in order. the set operation that
+ * follows cannot fail, so every recorded change reaches the tree */
+static void
+rb_delta_record_tree(rbtree_t *t, node_t *root, rb_op_t op)
+{
+	if (!t->track) return;
+	for (node_t *n = first_node(root); n; n = next_node(n))
+		rb_delta_record(t, n->key, op);
+}
+
+/* build_tree returns NULL both for nothing to build and out of memory, only
+ * the first is a success for the bulk paths */
+static bool
+rb_keys_empty(void **keys, size_t n)
+{
+	if (keys == NULL) return true;
+	for (size_t i = 0; i < n; i++)
+		if (keys[i]) return false;
+	return true;
+}
+
+bool
+tree_insert_bulk(rbtree_t *t, void **keys, size_t n, unsigned nthreads)
+{
+	node_t *block, *dropped;
+
+	rb_tree_settle(t);
+	node_t *root = build_tree(keys, n, nthreads, &block);
+	if (root == NULL) return rb_keys_empty(keys, n);
+	if (!rb_tree_adopt(t, block)) {
+		free(block);
+		return false;
+	}
+	rb_delta_record_tree(t, root, RB_OP_INSERT);
+
+	/* keys already in the tree drop the new node, it stays in the block */
+	t->root = union_trees(t->root, root, nthreads, &dropped);
+	free_nodes(dropped);
+	rb_tree_refinger(t);
+	rb_tree_thaw(t);
+	return true;
+}
+
+bool
+tree_delete_bulk(rbtree_t *t, void **keys, size_t n, unsigned nthreads)
+{
+	node_t *block, *dropped;
+
+	rb_tree_settle(t);
+	node_t *root = build_tree(keys, n, nthreads, &block);
+	if (root == NULL) return rb_keys_empty(keys, n);
+	rb_delta_record_tree(t, root, RB_OP_DELETE);
+
+	/* dropped holds the removed nodes and the whole temporary tree */
+	t->root = difference_trees(t->root, root, nthreads, &dropped);
+	free_nodes(dropped);
+	rb_tree_refinger(t);
+	rb_tree_thaw(t);
+	free(block);
+	return true;
+}
+
+/* swaps the compacted copy in for the tree, whose nodes and blocks all go */
+static bool
+rb_tree_compacted(rbtree_t *t)
+{
+	node_t **blocks = NULL;
+
+	if (t->root && t->compacted == NULL) return false;
+	if (t->compacted_block && (blocks = malloc(sizeof(*blocks))) == NULL) {
+		free(t->compacted_block);
+		return false;
+	}
+
+	free_tree(t->root);
+	for (size_t i = 0; i < t->nblocks; i++) free(t->blocks[i]);
+	free(t->blocks);
+	t->blocks  = blocks;
+	t->nblocks = 0;
+	if (blocks) t->blocks[t->nblocks++] = t->compacted_block;
+	t->root = t->compacted;
+
+	/* every node moved */
+	rb_tree_refinger(t);
+	rb_tree_thaw(t);
+	return true;
+}
+
+bool
+tree_compact(rbtree_t *t)
+{
+	if (t->compacting) return tree_compact_end(t);
+
+	t->compacted = compact_tree(t->root, &t->compacted_block);
+	return rb_tree_compacted(t);
+}
+
+static void *
+rb_compact_worker(void *arg)
+{
+	rbtree_t *t = arg;
+
+	t->compacted = compact_tree(t->root, &t->compacted_block);
+	return NULL;
+}
+
+bool
+tree_compact_begin(rbtree_t *t)
+{
+	if (t->compacting) return true;
+	if (pthread_create(&t->compactor, NULL, rb_compact_worker, t) != 0)
+		return false;
+	t->compacting = true;
+	return true;
+}
+
+bool
+tree_compact_end(rbtree_t *t)
+{
+	if (!t->compacting) return false;
+	pthread_join(t->compactor, NULL);
+	t->compacting = false;
+	return rb_tree_compacted(t);
+}
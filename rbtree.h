@@ -1,6 +1,15 @@
 #ifndef RBTREE_H
 #define RBTREE_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef enum {
 	RED = 1,
 	BLACK
@@ -14,14 +23,121 @@ typedef enum {
 #define IS_RED(n)	 ((n)->color == RED)
 #define IS_BLACK(n)	 ((n)->color == BLACK)
 
+/* per tree counters, maintained when the library is built with RB_STATS and
+ * only for operations done through a tree handle */
+typedef struct {
+	uint64_t inserts;		  /* keys added */
+	uint64_t deletes;		  /* keys removed */
+	uint64_t lookups;		  /* searches */
+	uint64_t comparisons;	  /* nodes visited by tree descents */
+	uint64_t rotations_left;  /* rb_rotate(LEFT) */
+	uint64_t rotations_right; /* rb_rotate(RIGHT) */
+	uint64_t color_flips;	  /* rb_color_flip */
+	uint64_t allocations;	  /* nodes allocated by create_node */
+	uint64_t max_depth;		  /* deepest node reached by a descent, root is 1 */
+} rb_stats_t;
+
+/* bit flags for each type of violation found by validate_tree */
+/* clang-format off */
+typedef enum {
+    RB_VALID                = 0x00, /* 00000000: no violations, clean state. */
+    RB_INVALID_COLOR        = 0x01, /* 00000001: rule 1 - invalid color. */
+    RB_RED_ROOT             = 0x02, /* 00000010: rule 2 - root is red. */
+    RB_NULL_NOT_BLACK       = 0x04, /* 00000100: rule 3 - leaf (NULL) nodes must be black. */
+    RB_RED_CHILD_OF_RED     = 0x08, /* 00001000: rule 4/7 - red node has a red child. */
+    RB_UNEQUAL_BLACK_PATHS  = 0x10, /* 00010000: rule 5 - black nodes in all paths are unequal. */
+    RB_UNORDERED_KEYS       = 0x20, /* 00100000: a key is out of search order (or NULL). */
+    RB_BAD_PARENT           = 0x40, /* 01000000: a parent pointer does not match the links. */
+    RB_BAD_RUN              = 0x80  /* 10000000: a multiset run length does not match its duplicates. */
+} rb_violation_t;
+/* clang-format on */
+
+typedef uint32_t rb_validation_t;
+/* if rb_validation_t is RB_RED_ROOT | RB_RED_CHILD_OF_RED
+ * x =  00000010 | 00001000
+ * x = 00001010
+ */
+
+/* depth histogram buckets, a valid tree of 2^64 nodes is at most 128 deep */
+#define RB_SHAPE_MAX_DEPTH 128
+
+/* shape of a tree, see tree_shape */
+typedef struct {
+	uint64_t nodes;
+	uint64_t red_nodes;
+	uint32_t height;			/* levels, 0 for an empty tree */
+	uint32_t black_height_min;	/* fewest black nodes from the root to a leaf */
+	uint32_t black_height_max;	/* most black nodes, equal to min if valid */
+	double	 avg_depth;			/* average nodes visited by a successful search */
+	double	 red_ratio;			/* red_nodes / nodes */
+	double	 height_bound;		/* 2 * log2(nodes + 1), the red-black limit */
+	uint64_t depth_hist[RB_SHAPE_MAX_DEPTH]; /* nodes per depth, root is 1 */
+} rb_shape_t;
+
 /* forward declartions  */
 typedef struct node_t node_t;
+typedef struct rbtree_t rbtree_t;
 
 /* clang-format off */
 node_t *create_node(void *val); /* initializes a node, all new nodes are RED initially */
-void insert_node(node_t **root, void *val); /* inserts a node, internlly it does santiy checkig and rebalance tree if needed */
-void delete_node(node_t *root, void *val); /* inserts a node, internlly it does santiy checkig and rebalance tree if needed */
-void search(node_t *n, void *query_key); /* search for a node */
-void range_search(node_t *n, node_t **out_list, void *query_key); /* range search for a given query */
+bool insert_node(node_t **root, void *val); /* inserts a node, internlly it does santiy checkig and rebalance tree if needed, false if the key was already there, or with errno set to ENOMEM if out of memory (clear errno first to tell them apart) */
+bool insert_pair(node_t **root, void *key, void *value); /* map mode insert, the node holds key and value, an existing key gets the new value in place. true if the key was new, false also when its node is a set node without room for a value or with errno set to ENOMEM if out of memory */
+node_t *insert_or_get(node_t **root, void *key, bool *created); /* one descent: returns the node holding key, linking a new one if it was absent (*created tells which, may be NULL). NULL with errno set to ENOMEM if out of memory */
+node_t *insert_or_get_hint(node_t **root, node_t *hint, void *key, bool *created); /* insert_or_get starting at any node of the tree: climbs from hint to the subtree covering key and descends from there, O(log d) for a key d positions from hint. NULL hint descends from the root */
+node_t *upsert(node_t **root, void *key, void *value, bool *created); /* insert_pair that returns the node and the created flag. NULL with errno set to ENOMEM if out of memory, or if the key's node is a set node (insert_node, build_tree) without room for a value */
+node_t *upsert_hint(node_t **root, node_t *hint, void *key, void *value, bool *created); /* upsert with a hint, as insert_or_get_hint */
+bool search_value(node_t *root, void *key, void **value); /* map mode lookup, stores the value of key in *value (if not NULL), false if absent */
+void *node_value(const node_t *n); /* value of a map mode node, NULL for a set node */
+bool set_node_value(node_t *n, void *value); /* replaces the value of a map mode node, false for a set node */
+bool delete_node(node_t **root, void *val); /* deletes the node holding val and rebalances the tree, the oldest one in a multiset tree. false if the key was not there */
+node_t *insert_multi(node_t **root, void *key, void *value); /* multiset mode insert, always links a new node holding key and value after the nodes already holding key. a multiset tree holds insert_multi nodes only, NULL if key is held by another kind of node, or with errno set to ENOMEM if out of memory */
+void erase_node(node_t **root, node_t *n); /* unlinks and frees n itself, e.g. one duplicate out of several */
+size_t count_key(node_t *root, void *key); /* number of nodes holding key, one descent */
+size_t equal_range(node_t *root, void *key, node_t **first, node_t **end); /* the nodes holding key are *first up to *end excluded (NULL past the last node), duplicates in insertion order. returns their count */
+node_t *search(node_t *n, void *query_key); /* search for a node, NULL if the key is not in the tree. any of the duplicates in a multiset tree */
+size_t search_batch(node_t *root, void **keys, size_t n, node_t **out); /* searches n keys at once with their descents interleaved so the cache misses overlap, out[i] is the node of keys[i] or NULL. returns how many were found */
+size_t range_search(node_t *n, node_t **out_list, size_t max, void *lo, void *hi); /* stores up to max nodes with keys in [lo, hi) in key order, returns how many */
+node_t *first_node(node_t *root); /* node with the smallest key */
+node_t *next_node(node_t *n); /* in-order successor, NULL after the last node */
+node_t *prev_node(node_t *n); /* in-order predecessor, NULL before the first node */
+void *node_key(const node_t *n); /* key of a node */
+rb_validation_t validate_tree(node_t *root); /* checks every red-black, order and parent link invariant in O(n), RB_VALID or a mask of rb_violation_t */
+void tree_shape(node_t *root, rb_shape_t *out); /* height, black heights, depth histogram and color stats in one O(n) pass */
+int write_shape_json(const rb_shape_t *shape, FILE *fp); /* one json object without a trailing newline, returns 0 or -1 */
+node_t *build_tree(void **keys, size_t n, unsigned nthreads, node_t **block); /* builds a balanced tree from unsorted keys in parallel, keys are sorted and deduplicated in place, all nodes live in *block (release with free once the tree is gone) */
+node_t *compact_tree(node_t *root, node_t **block); /* copies a tree into one block in van Emde Boas order, so descents touch few cache lines and pages at any size. the source is only read and can serve searches meanwhile, free it as usual and *block like a build_tree block. NULL for an empty tree or out of memory */
+node_t *join_trees(node_t *left, node_t *right); /* concatenates two trees, every key of left must be smaller than every key of right. distinct keys only, not for multiset trees */
+node_t *split_tree(node_t *root, void *key, node_t **left, node_t **right); /* splits a tree into keys below and above key, returns the detached node holding key or NULL. distinct keys only, not for multiset trees */
+node_t *union_trees(node_t *a, node_t *b, unsigned nthreads, node_t **dropped); /* both trees are consumed, duplicate nodes of b are chained into *dropped (or freed if dropped is NULL). distinct keys only, not for multiset trees */
+node_t *intersect_trees(node_t *a, node_t *b, unsigned nthreads, node_t **dropped); /* keeps the nodes of a whose key is also in b. distinct keys only, not for multiset trees */
+node_t *difference_trees(node_t *a, node_t *b, unsigned nthreads, node_t **dropped); /* keeps the nodes of a whose key is not in b. distinct keys only, not for multiset trees */
+node_t *detach_range(node_t **root, void *lo, void *hi); /* detaches the keys in [lo, hi) as a tree of their own in O(log n). NULL and nothing detached for a multiset tree */
+node_t *erase_range(node_t **root, void *lo, void *hi); /* removes the keys in [lo, hi), returns them in key order as a list of nodes for deferred freeing. NULL and nothing removed for a multiset tree */
+void free_tree(node_t *root); /* frees every node of a tree, nodes of a build_tree block are left to the block */
+void free_tree_async(node_t *root); /* same as free_tree, on a background thread */
+void free_nodes(node_t *list); /* frees a list of dropped nodes, nodes of a build_tree block are left to the block */
+void free_nodes_async(node_t *list); /* same as free_nodes, on a background thread */
+rbtree_t *create_tree(node_t *root, node_t *block); /* wraps a tree (or NULL) in a handle, the handle owns its nodes and the build_tree block */
+void destroy_tree(rbtree_t *t); /* frees the handle, its nodes and block */
+node_t *tree_root(const rbtree_t *t); /* current root of the tree */
+bool tree_insert(rbtree_t *t, void *key); /* insert_node on the handle, recorded for checkpoints */
+bool tree_insert_pair(rbtree_t *t, void *key, void *value); /* insert_pair on the handle, a new key is logged like tree_insert, values are not part of checkpoints */
+node_t *tree_insert_or_get(rbtree_t *t, void *key, bool *created); /* insert_or_get on the handle, a created key is logged like tree_insert */
+node_t *tree_upsert(rbtree_t *t, void *key, void *value, bool *created); /* upsert on the handle, a created key is logged like tree_insert. NULL for a key held by a set node, e.g. one from tree_insert_bulk or a checkpoint */
+void set_tree_finger(rbtree_t *t, bool on); /* finger mode: every insert on the handle starts at the node of the previous one, keys beyond either end link without a search */
+bool tree_delete(rbtree_t *t, void *key); /* delete_node on the handle, recorded for checkpoints */
+node_t *tree_search(rbtree_t *t, void *key); /* search on the handle, counted in its stats. answered from the snapshot of tree_freeze while there is one, which counts the lookup but no comparisons */
+size_t tree_search_batch(rbtree_t *t, void **keys, size_t n, node_t **out); /* search_batch on the handle, counted in its stats */
+bool tree_compact(rbtree_t *t); /* compact_tree on the handle, the copy replaces the tree and the old nodes and blocks are freed. node pointers into the tree are invalid afterwards, false if out of memory */
+bool tree_compact_begin(rbtree_t *t); /* starts tree_compact on a background thread, searches may go on meanwhile. the next mutation (or tree_compact_end) waits for it and swaps the copy in */
+bool tree_compact_end(rbtree_t *t); /* waits for tree_compact_begin and swaps the copy in, false if none was running or out of memory */
+bool tree_stats(const rbtree_t *t, rb_stats_t *out); /* copies the counters, false when built without RB_STATS */
+void reset_tree_stats(rbtree_t *t); /* zeroes the counters */
+bool tree_insert_bulk(rbtree_t *t, void **keys, size_t n, unsigned nthreads); /* build_tree the keys and union them into the tree, keys are reordered. false if out of memory, the tree is unchanged then */
+bool tree_delete_bulk(rbtree_t *t, void **keys, size_t n, unsigned nthreads); /* build_tree the keys and subtract them from the tree, keys are reordered. false if out of memory, the tree is unchanged then */
 /* clang-format on */
+
+#ifdef __cplusplus
+}
+#endif
 #endif
@@ -0,0 +1,959 @@
+#ifndef RBTREE_HPP
+#define RBTREE_HPP
+
+/* header-only c++ map, rb::map<K, V, Compare, Alloc>
+ * the c core orders void * keys by their value and keeps node_t opaque, so it
+ * cannot hold a typed key or a comparator. the map runs the same algorithms
+ * (red-black insert fixup, relinking delete) on nodes that hold a
+ * std::pair<const K, V> inline. the rebalancing lives in rb::detail on an
+ * untyped node_base and is shared by every instantiation, only the descents
+ * that call Compare are templates.
+ *
+ * the interface follows std::map: bidirectional iterators that stay valid
+ * until their element is erased, emplace and try_emplace constructing the
+ * value in the node, move-only mapped types, and node handles (extract and
+ * insert) that move nodes between maps of the same type without allocating.
+ * nodes come from Alloc rebound to the node type. */
+#include "rbtree.h"
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace rb {
+
+template <typename K, typename V, typename Compare, typename Alloc>
+class map;
+
+namespace detail {
+
+struct node_base {
+	node_base *parent;
+	node_base *left;
+	node_base *right;
+	color_t	   color;
+};
+
+inline node_base *
+first(node_base *n)
+{
+	if (n)
+		while (n->left) n = n->left;
+	return n;
+}
+
+inline node_base *
+last(node_base *n)
+{
+	if (n)
+		while (n->right) n = n->right;
+	return n;
+}
+
+inline node_base *
+next(node_base *n)
+{
+	if (n->right) return first(n->right);
+	while (n->parent && n == n->parent->right) n = n->parent;
+	return n->parent;
+}
+
+inline node_base *
+prev(node_base *n)
+{
+	if (n->left) return last(n->left);
+	while (n->parent && n == n->parent->left) n = n->parent;
+	return n->parent;
+}
+
+/* left moves node->right up into node's place, otherwise node->left */
+inline void
+rotate(node_base *&root, node_base *node, bool left)
+{
+	node_base *pivot = left ? node->right : node->left;
+
+	if (left) {
+		node->right = pivot->left;
+		if (pivot->left) pivot->left->parent = node;
+		pivot->left = node;
+	} else {
+		node->left = pivot->right;
+		if (pivot->right) pivot->right->parent = node;
+		pivot->right = node;
+	}
+	pivot->parent = node->parent;
+	if (node->parent == nullptr)
+		root = pivot;
+	else if (node->parent->left == node)
+		node->parent->left = pivot;
+	else
+		node->parent->right = pivot;
+	node->parent = pivot;
+}
+
+/* hangs n at *slot under parent (found by the caller's descent) and
+ * rebalances */
+inline void
+link(node_base *&root, node_base *parent, node_base **slot, node_base *n)
+{
+	n->parent = parent;
+	n->left = n->right = nullptr;
+	n->color		   = RED;
+	*slot			   = n;
+
+	while (n->parent && n->parent->color == RED) {
+		node_base *p	 = n->parent, *g = p->parent;
+		bool	   pleft = p == g->left;
+		node_base *aunt	 = pleft ? g->right : g->left;
+
+		if (aunt && aunt->color == RED) {
+			g->color = RED;
+			p->color = aunt->color = BLACK;
+			n					   = g;
+			continue;
+		}
+		if (n == (pleft ? p->right : p->left)) {
+			rotate(root, p, pleft);
+			p = n;
+		}
+		rotate(root, g, !pleft);
+		p->color = BLACK;
+		g->color = RED;
+		break;
+	}
+	root->color = BLACK;
+}
+
+inline void
+transplant(node_base *&root, node_base *n, node_base *child)
+{
+	if (n->parent == nullptr)
+		root = child;
+	else if (n == n->parent->left)
+		n->parent->left = child;
+	else
+		n->parent->right = child;
+	if (child) child->parent = n->parent;
+}
+
+/* unlinks z, the successor takes its place when z has two children */
+inline void
+unlink(node_base *&root, node_base *z)
+{
+	node_base *x, *xparent;
+	color_t	   removed = z->color;
+
+	if (z->left == nullptr || z->right == nullptr) {
+		x		= z->left ? z->left : z->right;
+		xparent = z->parent;
+		transplant(root, z, x);
+	} else {
+		node_base *y = first(z->right);
+
+		removed = y->color;
+		x		= y->right;
+		if (y->parent == z) {
+			xparent = y;
+		} else {
+			xparent = y->parent;
+			transplant(root, y, y->right);
+			y->right		 = z->right;
+			y->right->parent = y;
+		}
+		transplant(root, z, y);
+		y->left			= z->left;
+		y->left->parent = y;
+		y->color		= z->color;
+	}
+	z->parent = z->left = z->right = nullptr;
+	if (removed == RED) return;
+
+	/* x sits on a path that lost a black node */
+	while (x != root && (x == nullptr || x->color == BLACK)) {
+		bool	   left = x == xparent->left;
+		node_base *w	= left ? xparent->right : xparent->left;
+
+		if (w->color == RED) {
+			w->color	   = BLACK;
+			xparent->color = RED;
+			rotate(root, xparent, left);
+			w = left ? xparent->right : xparent->left;
+		}
+
+		node_base *near = left ? w->left : w->right;
+		node_base *far	= left ? w->right : w->left;
+
+		if ((near == nullptr || near->color == BLACK) &&
+			(far == nullptr || far->color == BLACK)) {
+			w->color = RED;
+			x		 = xparent;
+			xparent	 = x->parent;
+			continue;
+		}
+		if (far == nullptr || far->color == BLACK) {
+			near->color = BLACK;
+			w->color	= RED;
+			rotate(root, w, !left);
+			w	= left ? xparent->right : xparent->left;
+			far = left ? w->right : w->left;
+		}
+		w->color	   = xparent->color;
+		xparent->color = BLACK;
+		far->color	   = BLACK;
+		rotate(root, xparent, left);
+		x = root;
+	}
+	if (x) x->color = BLACK;
+}
+
+template <typename Value>
+struct node : node_base {
+	typename std::aligned_storage<sizeof(Value), alignof(Value)>::type storage;
+
+	Value *
+	value()
+	{
+		return reinterpret_cast<Value *>(&storage);
+	}
+};
+
+/* end() is the null node, decrementing it needs the tree root */
+template <typename Value, bool Const>
+class iterator {
+	template <typename, typename, typename, typename>
+	friend class rb::map;
+	friend class iterator<Value, !Const>;
+
+	node_base		 *n_;
+	node_base *const *root_;
+
+	iterator(node_base *n, node_base *const *root) : n_(n), root_(root) {}
+
+public:
+	typedef std::bidirectional_iterator_tag iterator_category;
+	typedef Value							value_type;
+	typedef std::ptrdiff_t					difference_type;
+	typedef typename std::conditional<Const, const Value *, Value *>::type
+		pointer;
+	typedef typename std::conditional<Const, const Value &, Value &>::type
+		reference;
+
+	iterator() : n_(nullptr), root_(nullptr) {}
+
+	/* iterator converts to const_iterator, not the other way */
+	template <bool C, typename = typename std::enable_if<Const && !C>::type>
+	iterator(const iterator<Value, C> &it) : n_(it.n_), root_(it.root_)
+	{
+	}
+
+	reference
+	operator*() const
+	{
+		return *static_cast<node<Value> *>(n_)->value();
+	}
+
+	pointer
+	operator->() const
+	{
+		return static_cast<node<Value> *>(n_)->value();
+	}
+
+	iterator &
+	operator++()
+	{
+		n_ = next(n_);
+		return *this;
+	}
+
+	iterator
+	operator++(int)
+	{
+		iterator it = *this;
+		++*this;
+		return it;
+	}
+
+	iterator &
+	operator--()
+	{
+		n_ = n_ ? prev(n_) : last(*root_);
+		return *this;
+	}
+
+	iterator
+	operator--(int)
+	{
+		iterator it = *this;
+		--*this;
+		return it;
+	}
+
+	template <bool C>
+	bool
+	operator==(const iterator<Value, C> &o) const
+	{
+		return n_ == o.n_;
+	}
+
+	template <bool C>
+	bool
+	operator!=(const iterator<Value, C> &o) const
+	{
+		return n_ != o.n_;
+	}
+};
+
+} // namespace detail
+
+template <typename K, typename V, typename Compare = std::less<K>,
+		  typename Alloc = std::allocator<std::pair<const K, V>>>
+class map {
+public:
+	typedef K								key_type;
+	typedef V								mapped_type;
+	typedef std::pair<const K, V>			value_type;
+	typedef Compare							key_compare;
+	typedef Alloc							allocator_type;
+	typedef std::size_t						size_type;
+	typedef std::ptrdiff_t					difference_type;
+	typedef value_type					   &reference;
+	typedef const value_type			   &const_reference;
+	typedef detail::iterator<value_type, false> iterator;
+	typedef detail::iterator<value_type, true>	const_iterator;
+	typedef std::reverse_iterator<iterator>		reverse_iterator;
+	typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+private:
+	typedef detail::node_base		  base_t;
+	typedef detail::node<value_type> node_t;
+	typedef typename std::allocator_traits<Alloc>::template rebind_alloc<node_t>
+		node_alloc_t;
+	typedef std::allocator_traits<node_alloc_t> node_traits;
+
+	/* the comparator and the allocator are usually empty, deriving from them
+	 * keeps them from taking space */
+	struct impl : Compare, node_alloc_t {
+		base_t	 *root;
+		size_type size;
+
+		impl(const Compare &c, const node_alloc_t &a)
+			: Compare(c), node_alloc_t(a), root(nullptr), size(0)
+		{
+		}
+	} t_;
+
+public:
+	/* owns one extracted node, move only */
+	class node_type {
+		friend class map;
+
+		node_t		*n_;
+		node_alloc_t alloc_;
+
+		node_type(node_t *n, const node_alloc_t &a) : n_(n), alloc_(a) {}
+
+		void
+		reset()
+		{
+			if (n_ == nullptr) return;
+			node_traits::destroy(alloc_, n_->value());
+			node_traits::deallocate(alloc_, n_, 1);
+			n_ = nullptr;
+		}
+
+	public:
+		typedef K	  key_type;
+		typedef V	  mapped_type;
+		typedef Alloc allocator_type;
+
+		node_type() : n_(nullptr) {}
+		node_type(node_type &&o) : n_(o.n_), alloc_(std::move(o.alloc_))
+		{
+			o.n_ = nullptr;
+		}
+		~node_type() { reset(); }
+
+		node_type &
+		operator=(node_type &&o)
+		{
+			if (this != &o) {
+				reset();
+				n_	   = o.n_;
+				alloc_ = std::move(o.alloc_);
+				o.n_   = nullptr;
+			}
+			return *this;
+		}
+
+		node_type(const node_type &)			= delete;
+		node_type &operator=(const node_type &) = delete;
+
+		bool
+		empty() const
+		{
+			return n_ == nullptr;
+		}
+
+		explicit operator bool() const { return n_ != nullptr; }
+
+		/* the key may be changed before the node goes back into a map */
+		key_type &
+		key() const
+		{
+			return const_cast<key_type &>(n_->value()->first);
+		}
+
+		mapped_type &
+		mapped() const
+		{
+			return n_->value()->second;
+		}
+	};
+
+	struct insert_return_type {
+		iterator  position;
+		bool	  inserted;
+		node_type node;
+	};
+
+	map() : t_(Compare(), node_alloc_t()) {}
+	explicit map(const Compare &c, const Alloc &a = Alloc())
+		: t_(c, node_alloc_t(a))
+	{
+	}
+	explicit map(const Alloc &a) : t_(Compare(), node_alloc_t(a)) {}
+
+	map(std::initializer_list<value_type> il, const Compare &c = Compare(),
+		const Alloc &a = Alloc())
+		: t_(c, node_alloc_t(a))
+	{
+		/* ~map does not run for a constructor that throws */
+		try {
+			for (const value_type &v : il) emplace(v);
+		} catch (...) {
+			clear();
+			throw;
+		}
+	}
+
+	map(const map &o)
+		: t_(o.key_comp(),
+			 node_traits::select_on_container_copy_construction(o.node_alloc()))
+	{
+		try {
+			for (const value_type &v : o) emplace_hint(end(), v);
+		} catch (...) {
+			clear();
+			throw;
+		}
+	}
+
+	map(map &&o) : t_(std::move(o.t_)) { o.t_.root = nullptr, o.t_.size = 0; }
+
+	~map() { clear(); }
+
+	map &
+	operator=(const map &o)
+	{
+		if (this != &o) {
+			map tmp(o);
+			swap(tmp);
+		}
+		return *this;
+	}
+
+	map &
+	operator=(map &&o)
+	{
+		if (this != &o) {
+			clear();
+			swap(o);
+		}
+		return *this;
+	}
+
+	void
+	swap(map &o)
+	{
+		using std::swap;
+		swap(static_cast<Compare &>(t_), static_cast<Compare &>(o.t_));
+		swap(static_cast<node_alloc_t &>(t_), static_cast<node_alloc_t &>(o.t_));
+		swap(t_.root, o.t_.root);
+		swap(t_.size, o.t_.size);
+	}
+
+	key_compare
+	key_comp() const
+	{
+		return t_;
+	}
+
+	allocator_type
+	get_allocator() const
+	{
+		return allocator_type(node_alloc());
+	}
+
+	bool
+	empty() const
+	{
+		return t_.size == 0;
+	}
+
+	size_type
+	size() const
+	{
+		return t_.size;
+	}
+
+	size_type
+	max_size() const
+	{
+		return node_traits::max_size(node_alloc());
+	}
+
+	iterator
+	begin()
+	{
+		return iterator(detail::first(t_.root), &t_.root);
+	}
+
+	const_iterator
+	begin() const
+	{
+		return const_iterator(detail::first(t_.root), &t_.root);
+	}
+
+	iterator
+	end()
+	{
+		return iterator(nullptr, &t_.root);
+	}
+
+	const_iterator
+	end() const
+	{
+		return const_iterator(nullptr, &t_.root);
+	}
+
+	const_iterator
+	cbegin() const
+	{
+		return begin();
+	}
+
+	const_iterator
+	cend() const
+	{
+		return end();
+	}
+
+	reverse_iterator
+	rbegin()
+	{
+		return reverse_iterator(end());
+	}
+
+	const_reverse_iterator
+	rbegin() const
+	{
+		return const_reverse_iterator(end());
+	}
+
+	reverse_iterator
+	rend()
+	{
+		return reverse_iterator(begin());
+	}
+
+	const_reverse_iterator
+	rend() const
+	{
+		return const_reverse_iterator(begin());
+	}
+
+	iterator
+	find(const K &k)
+	{
+		base_t *n = lower(k);
+		return iterator(n && !less(k, key(n)) ? n : nullptr, &t_.root);
+	}
+
+	const_iterator
+	find(const K &k) const
+	{
+		return const_cast<map *>(this)->find(k);
+	}
+
+	size_type
+	count(const K &k) const
+	{
+		return find(k) != end();
+	}
+
+	iterator
+	lower_bound(const K &k)
+	{
+		return iterator(lower(k), &t_.root);
+	}
+
+	const_iterator
+	lower_bound(const K &k) const
+	{
+		return const_cast<map *>(this)->lower_bound(k);
+	}
+
+	iterator
+	upper_bound(const K &k)
+	{
+		base_t *n = t_.root, *found = nullptr;
+		while (n) {
+			if (less(k, key(n))) {
+				found = n;
+				n	  = n->left;
+			} else {
+				n = n->right;
+			}
+		}
+		return iterator(found, &t_.root);
+	}
+
+	const_iterator
+	upper_bound(const K &k) const
+	{
+		return const_cast<map *>(this)->upper_bound(k);
+	}
+
+	std::pair<iterator, iterator>
+	equal_range(const K &k)
+	{
+		iterator it = find(k);
+		if (it == end()) return std::make_pair(lower_bound(k), lower_bound(k));
+		iterator after = it;
+		return std::make_pair(it, ++after);
+	}
+
+	std::pair<const_iterator, const_iterator>
+	equal_range(const K &k) const
+	{
+		return const_cast<map *>(this)->equal_range(k);
+	}
+
+	V &
+	at(const K &k)
+	{
+		iterator it = find(k);
+		if (it == end()) throw std::out_of_range("rb::map::at");
+		return it->second;
+	}
+
+	const V &
+	at(const K &k) const
+	{
+		return const_cast<map *>(this)->at(k);
+	}
+
+	V &
+	operator[](const K &k)
+	{
+		return try_emplace(k).first->second;
+	}
+
+	V &
+	operator[](K &&k)
+	{
+		return try_emplace(std::move(k)).first->second;
+	}
+
+	std::pair<iterator, bool>
+	insert(const value_type &v)
+	{
+		return emplace(v);
+	}
+
+	template <typename P, typename = typename std::enable_if<
+							  std::is_constructible<value_type, P &&>::value>::type>
+	std::pair<iterator, bool>
+	insert(P &&v)
+	{
+		return emplace(std::forward<P>(v));
+	}
+
+	template <typename It>
+	void
+	insert(It first, It last)
+	{
+		for (; first != last; ++first) emplace(*first);
+	}
+
+	/* the value is built in a fresh node first, the node is dropped again
+	 * if the key is already there. try_emplace avoids that */
+	template <typename... Args>
+	std::pair<iterator, bool>
+	emplace(Args &&...args)
+	{
+		node_t *n	= make_node(std::forward<Args>(args)...);
+		base_t *pos = place(key(n), n);
+		if (pos != n) drop_node(n);
+		return std::make_pair(iterator(pos, &t_.root), pos == n);
+	}
+
+	/* the hint is ignored, the descent is one pass from the root anyway */
+	template <typename... Args>
+	iterator
+	emplace_hint(const_iterator, Args &&...args)
+	{
+		return emplace(std::forward<Args>(args)...).first;
+	}
+
+	/* constructs the mapped value only if k is absent, args are left alone
+	 * otherwise (so a moved-from unique_ptr stays with the caller) */
+	template <typename KK, typename... Args>
+	std::pair<iterator, bool>
+	try_emplace(KK &&k, Args &&...args)
+	{
+		base_t	*parent = nullptr;
+		base_t **slot	= &t_.root;
+
+		if (base_t *found = descend(k, parent, slot))
+			return std::make_pair(iterator(found, &t_.root), false);
+
+		node_t *n = make_node(std::piecewise_construct,
+							  std::forward_as_tuple(std::forward<KK>(k)),
+							  std::forward_as_tuple(std::forward<Args>(args)...));
+		detail::link(t_.root, parent, slot, n);
+		t_.size++;
+		return std::make_pair(iterator(n, &t_.root), true);
+	}
+
+	template <typename M>
+	std::pair<iterator, bool>
+	insert_or_assign(const K &k, M &&m)
+	{
+		std::pair<iterator, bool> r = try_emplace(k, std::forward<M>(m));
+		if (!r.second) r.first->second = std::forward<M>(m);
+		return r;
+	}
+
+	/* unlinks the node, ownership passes to the handle */
+	node_type
+	extract(const_iterator pos)
+	{
+		base_t *n = pos.n_;
+		detail::unlink(t_.root, n);
+		t_.size--;
+		return node_type(static_cast<node_t *>(n), node_alloc());
+	}
+
+	node_type
+	extract(const K &k)
+	{
+		iterator it = find(k);
+		return it == end() ? node_type() : extract(it);
+	}
+
+	/* links the node of an extracted handle, nothing is allocated. if the key
+	 * is present the handle comes back in the result */
+	insert_return_type
+	insert(node_type &&nh)
+	{
+		insert_return_type r{end(), false, node_type()};
+
+		if (nh.empty()) return r;
+		base_t *pos = place(key(nh.n_), nh.n_);
+		r.position	= iterator(pos, &t_.root);
+		r.inserted	= pos == nh.n_;
+		if (r.inserted)
+			nh.n_ = nullptr;
+		else
+			r.node = std::move(nh);
+		return r;
+	}
+
+	iterator
+	insert(const_iterator, node_type &&nh)
+	{
+		return insert(std::move(nh)).position;
+	}
+
+	/* moves every node whose key is absent here out of o */
+	void
+	merge(map &o)
+	{
+		for (base_t *n = detail::first(o.t_.root), *nx; n; n = nx) {
+			nx = detail::next(n);
+			if (descend_only(key(n)) != nullptr) continue;
+			detail::unlink(o.t_.root, n);
+			o.t_.size--;
+			place(key(n), static_cast<node_t *>(n));
+		}
+	}
+
+	iterator
+	erase(const_iterator pos)
+	{
+		base_t *n = pos.n_, *nx = detail::next(n);
+		detail::unlink(t_.root, n);
+		t_.size--;
+		drop_node(static_cast<node_t *>(n));
+		return iterator(nx, &t_.root);
+	}
+
+	iterator
+	erase(iterator pos)
+	{
+		return erase(const_iterator(pos));
+	}
+
+	iterator
+	erase(const_iterator first, const_iterator last)
+	{
+		while (first != last) first = erase(first);
+		return iterator(last.n_, &t_.root);
+	}
+
+	size_type
+	erase(const K &k)
+	{
+		iterator it = find(k);
+		if (it == end()) return 0;
+		erase(it);
+		return 1;
+	}
+
+	/* frees bottom up through the parent pointers, no rebalancing */
+	void
+	clear()
+	{
+		base_t *n = t_.root;
+
+		while (n) {
+			if (n->left) {
+				n = n->left;
+			} else if (n->right) {
+				n = n->right;
+			} else {
+				base_t *parent = n->parent;
+				if (parent) (parent->left == n ? parent->left : parent->right) = nullptr;
+				drop_node(static_cast<node_t *>(n));
+				n = parent;
+			}
+		}
+		t_.root = nullptr;
+		t_.size = 0;
+	}
+
+private:
+	const node_alloc_t &
+	node_alloc() const
+	{
+		return t_;
+	}
+
+	node_alloc_t &
+	node_alloc()
+	{
+		return t_;
+	}
+
+	static const K &
+	key(base_t *n)
+	{
+		return static_cast<node_t *>(n)->value()->first;
+	}
+
+	bool
+	less(const K &a, const K &b) const
+	{
+		return static_cast<const Compare &>(t_)(a, b);
+	}
+
+	/* runs to a leaf like the RB_GENERATE descent, the child is picked by a
+	 * select rather than a branch on the comparison */
+	base_t *
+	lower(const K &k) const
+	{
+		base_t *n = t_.root, *found = nullptr;
+		while (n) {
+			bool right = less(key(n), k);
+			found	   = right ? found : n;
+			n		   = right ? n->right : n->left;
+		}
+		return found;
+	}
+
+	/* returns the node holding k, or nullptr with parent and slot set to
+	 * where k belongs */
+	base_t *
+	descend(const K &k, base_t *&parent, base_t **&slot)
+	{
+		while (*slot) {
+			parent = *slot;
+			if (less(k, key(parent)))
+				slot = &parent->left;
+			else if (less(key(parent), k))
+				slot = &parent->right;
+			else
+				return parent;
+		}
+		return nullptr;
+	}
+
+	base_t *
+	descend_only(const K &k)
+	{
+		base_t	*parent = nullptr;
+		base_t **slot	= &t_.root;
+		return descend(k, parent, slot);
+	}
+
+	/* links n under k unless k is present, returns the node holding k */
+	base_t *
+	place(const K &k, node_t *n)
+	{
+		base_t	*parent = nullptr;
+		base_t **slot	= &t_.root;
+
+		if (base_t *found = descend(k, parent, slot)) return found;
+		detail::link(t_.root, parent, slot, n);
+		t_.size++;
+		return n;
+	}
+
+	template <typename... Args>
+	node_t *
+	make_node(Args &&...args)
+	{
+		node_t *n = node_traits::allocate(node_alloc(), 1);
+		try {
+			node_traits::construct(node_alloc(), n->value(),
+								   std::forward<Args>(args)...);
+		} catch (...) {
+			node_traits::deallocate(node_alloc(), n, 1);
+			throw;
+		}
+		return n;
+	}
+
+	void
+	drop_node(node_t *n)
+	{
+		node_traits::destroy(node_alloc(), n->value());
+		node_traits::deallocate(node_alloc(), n, 1);
+	}
+};
+
+template <typename K, typename V, typename C, typename A>
+inline void
+swap(map<K, V, C, A> &a, map<K, V, C, A> &b)
+{
+	a.swap(b);
+}
+
+} // namespace rb
+#endif
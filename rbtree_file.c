@@ -0,0 +1,213 @@
+#include "rbtree_file.h"
+#include "rbtree_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct rb_file_t {
+	const rb_file_header_t *header; /* start of the mapping */
+	const rb_file_node_t   *nodes;	/* records right after the header */
+	size_t					size;	/* length of the mapping */
+};
+
+/* state of a write, records are numbered in the order they hit the file */
+typedef struct {
+	FILE	*fp;
+	uint64_t count;
+	uint64_t checksum;
+	bool	 failed;
+} rb_file_writer_t;
+
+/* postorder, returns the index of the record written for n */
+static uint32_t
+rb_file_write_node(rb_file_writer_t *w, node_t *n)
+{
+	if (n == NULL || w->failed) return RB_FILE_NIL;
+
+	rb_file_node_t rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.left  = rb_file_write_node(w, n->left);
+	rec.right = rb_file_write_node(w, n->right);
+	rec.key	  = (uint64_t)(uintptr_t)n->key;
+
+	if (w->failed) return RB_FILE_NIL;
+	if (w->count >= RB_FILE_MAX_NODES) {
+		errno	  = EFBIG;
+		w->failed = true;
+		return RB_FILE_NIL;
+	}
+	if (fwrite(&rec, sizeof(rec), 1, w->fp) != 1) {
+		w->failed = true;
+		return RB_FILE_NIL;
+	}
+	w->checksum = rb_fnv1a(w->checksum, &rec, sizeof(rec));
+	return (uint32_t)w->count++;
+}
+
+/* syncs the directory holding path, so a rename into it is durable */
+static int
+rb_file_sync_dir(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	size_t		len	  = slash ? (size_t)(slash - path) : 0;
+	char	   *dir	  = malloc(len + 2);
+
+	if (dir == NULL) return -1;
+	if (slash == NULL)
+		strcpy(dir, ".");
+	else if (len == 0)
+		strcpy(dir, "/");
+	else {
+		memcpy(dir, path, len);
+		dir[len] = '\0';
+	}
+
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	free(dir);
+	if (fd < 0) return -1;
+	int ret	  = fsync(fd);
+	int saved = errno;
+	close(fd);
+	errno = saved;
+	return ret;
+}
+
+/* the tree goes to path.tmp, which is synced and renamed over path, so a
+ * crash or a failed write leaves the old file whole and readers that have it
+ * mapped keep their copy */
+int
+write_tree_file(node_t *root, const char *path)
+{
+	rb_file_header_t header;
+	rb_file_writer_t w	 = {NULL, 0, RB_FNV_OFFSET, false};
+	size_t			 len = strlen(path);
+	char			*tmp = malloc(len + sizeof(".tmp"));
+
+	if (tmp == NULL) return -1;
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, ".tmp", sizeof(".tmp"));
+
+	w.fp = fopen(tmp, "wb");
+	if (w.fp == NULL) {
+		free(tmp);
+		return -1;
+	}
+
+	/* the header is rewritten once the node count is known */
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RB_FILE_MAGIC, sizeof(header.magic));
+	if (fwrite(&header, sizeof(header), 1, w.fp) != 1) w.failed = true;
+
+	header.root = rb_file_write_node(&w, root);
+	for (node_t *n = root; n; n = n->left)
+		if (IS_BLACK(n)) header.black_height++;
+	header.count	= w.count;
+	header.checksum = w.checksum;
+
+	if (!w.failed && (fseek(w.fp, 0, SEEK_SET) != 0 ||
+					  fwrite(&header, sizeof(header), 1, w.fp) != 1 ||
+					  fflush(w.fp) != 0 || fsync(fileno(w.fp)) != 0))
+		w.failed = true;
+
+	int saved = errno;
+	if (fclose(w.fp) != 0 && !w.failed) {
+		w.failed = true;
+		saved	 = errno;
+	}
+	if (!w.failed && rename(tmp, path) != 0) {
+		w.failed = true;
+		saved	 = errno;
+	}
+	if (w.failed) {
+		unlink(tmp);
+		free(tmp);
+		errno = saved;
+		return -1;
+	}
+	free(tmp);
+	return rb_file_sync_dir(path);
+}
+
+rb_file_t *
+open_tree_file(const char *path, bool verify)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+	if ((size_t)st.st_size < sizeof(rb_file_header_t)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return NULL;
+
+	rb_file_t *f = malloc(sizeof(*f));
+	if (f == NULL) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	f->header = map;
+	f->nodes  = (const rb_file_node_t *)(f->header + 1);
+	f->size	  = st.st_size;
+
+	/* sanity check the header against the file size */
+	const rb_file_header_t *h  = f->header;
+	bool					ok = memcmp(h->magic, RB_FILE_MAGIC, 8) == 0 &&
+			  h->count <= RB_FILE_MAX_NODES &&
+			  f->size == sizeof(*h) + h->count * sizeof(rb_file_node_t) &&
+			  (h->count == 0 ? h->root == RB_FILE_NIL : h->root < h->count);
+
+	if (ok && verify)
+		ok = rb_fnv1a(RB_FNV_OFFSET, f->nodes,
+					  h->count * sizeof(rb_file_node_t)) == h->checksum;
+
+	if (!ok) {
+		close_tree_file(f);
+		errno = EINVAL;
+		return NULL;
+	}
+	return f;
+}
+
+bool
+search_tree_file(const rb_file_t *f, void *query_key)
+{
+	uint64_t key   = (uint64_t)(uintptr_t)query_key;
+	uint32_t i	   = f->header->root;
+	uint64_t count = f->header->count;
+
+	/* every step goes down one level, a corrupt file can not loop forever */
+	for (uint64_t steps = 0; i < count && steps < count; steps++) {
+		const rb_file_node_t *n = &f->nodes[i];
+		if (key == n->key) return true;
+		i = key < n->key ? n->left : n->right;
+	}
+	return false;
+}
+
+uint64_t
+tree_file_count(const rb_file_t *f)
+{
+	return f->header->count;
+}
+
+void
+close_tree_file(rb_file_t *f)
+{
+	if (f == NULL) return;
+	munmap((void *)f->header, f->size);
+	free(f);
+}
@@ -0,0 +1,52 @@
+#ifndef RBTREE_FILE_H
+#define RBTREE_FILE_H
+
+#include "rbtree.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/* on-disk tree format
+ * a header followed by one record per node. records are written in postorder
+ * so both children of a node are already on disk when the node itself is
+ * written, the root is the last record. links are record indexes, keys are
+ * stored as fixed-width 64 bit values (the tree orders keys by address, so
+ * this only round trips integer keys stored in the pointer). the file is
+ * searched in place through a read-only mapping, nothing is deserialized.
+ * all fields are in host byte order. */
+
+#define RB_FILE_MAGIC	"RBTREE\0\1" /* 8 bytes, the last one is the version */
+#define RB_FILE_NIL		UINT32_MAX	 /* NULL link */
+#define RB_FILE_MAX_NODES (UINT32_MAX - 1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+	char	 magic[8];	   /* RB_FILE_MAGIC */
+	uint64_t count;		   /* number of node records */
+	uint32_t black_height; /* black height of the tree when written */
+	uint32_t root;		   /* index of the root record, RB_FILE_NIL if empty */
+	uint64_t checksum;	   /* fnv-1a over the node records */
+} rb_file_header_t;
+
+typedef struct {
+	uint64_t key;	/* key value */
+	uint32_t left;	/* index of the left child record */
+	uint32_t right; /* index of the right child record */
+} rb_file_node_t;
+
+typedef struct rb_file_t rb_file_t;
+
+/* clang-format off */
+int write_tree_file(node_t *root, const char *path); /* serializes a tree in one sequential pass into path.tmp, then renames it over path, returns 0 or -1 with errno set */
+rb_file_t *open_tree_file(const char *path, bool verify); /* maps a tree file read-only, verify also checks the checksum (O(n)) */
+bool search_tree_file(const rb_file_t *f, void *query_key); /* searches the mapped tree in place */
+uint64_t tree_file_count(const rb_file_t *f); /* number of keys in the file */
+void close_tree_file(rb_file_t *f); /* unmaps the file */
+/* clang-format on */
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,172 @@
+#include "rbtree_frozen.h"
+#include "rbtree_internal.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define RB_FROZEN_AVX2
+#endif
+
+/* keys are stored with the sign bit flipped, so the signed 64 bit compares
+ * of avx2 order them like the unsigned addresses they are */
+#define RB_FROZEN_SIGN ((uint64_t)1 << 63)
+#define RB_FROZEN_PAD  INT64_MAX /* UINTPTR_MAX flipped, past every key */
+
+struct rb_frozen_t {
+	int64_t *keys;	 /* nblocks * RB_FROZEN_BLOCK flipped keys, line aligned */
+	node_t **nodes;	 /* node of every slot, NULL for padding */
+	size_t	 nblocks;
+	size_t	 count;
+	bool	 avx2;	 /* rank blocks with avx2 */
+};
+
+static inline int64_t
+rb_frozen_flip(const void *key)
+{
+	return (int64_t)((uint64_t)(uintptr_t)key ^ RB_FROZEN_SIGN);
+}
+
+static inline size_t
+rb_frozen_child(size_t k, size_t i)
+{
+	return k * (RB_FROZEN_BLOCK + 1) + 1 + i;
+}
+
+/* in-order over the implicit tree, so the slots take the keys in order. the
+ * padding of the last blocks ends up after every key */
+static void
+rb_frozen_fill(rb_frozen_t *f, size_t k, node_t **it)
+{
+	if (k >= f->nblocks) return;
+
+	for (size_t i = 0; i < RB_FROZEN_BLOCK; i++) {
+		rb_frozen_fill(f, rb_frozen_child(k, i), it);
+
+		size_t s	= k * RB_FROZEN_BLOCK + i;
+		f->nodes[s] = *it;
+		f->keys[s]	= RB_FROZEN_PAD;
+		if (*it) {
+			f->keys[s] = rb_frozen_flip((*it)->key);
+			*it		   = next_node(*it);
+		}
+	}
+	rb_frozen_fill(f, rb_frozen_child(k, RB_FROZEN_BLOCK), it);
+}
+
+rb_frozen_t *
+freeze_tree(node_t *root)
+{
+	rb_frozen_t *f = calloc(1, sizeof(*f));
+	if (f == NULL) return NULL;
+
+	for (node_t *n = first_node(root); n; n = next_node(n)) f->count++;
+	f->nblocks = (f->count + RB_FROZEN_BLOCK - 1) / RB_FROZEN_BLOCK;
+#ifdef RB_FROZEN_AVX2
+	f->avx2 = __builtin_cpu_supports("avx2");
+#endif
+	if (f->nblocks == 0) return f;
+
+	size_t slots = f->nblocks * RB_FROZEN_BLOCK;
+	f->keys		 = aligned_alloc(64, slots * sizeof(int64_t));
+	f->nodes	 = malloc(slots * sizeof(node_t *));
+	if (f->keys == NULL || f->nodes == NULL) {
+		free_frozen(f);
+		return NULL;
+	}
+
+	node_t *it = first_node(root);
+	rb_frozen_fill(f, 0, &it);
+	return f;
+}
+
+/* slot of the smallest key >= x, SIZE_MAX if there is none. the number of
+ * keys of a block below x picks the child to descend into, and the slot
+ * right after them is the best bound so far */
+static size_t
+rb_frozen_lower_scalar(const rb_frozen_t *f, int64_t x)
+{
+	size_t found = SIZE_MAX;
+
+	for (size_t k = 0; k < f->nblocks;) {
+		const int64_t *b = f->keys + k * RB_FROZEN_BLOCK;
+		size_t		   i = 0;
+		for (size_t j = 0; j < RB_FROZEN_BLOCK; j++) i += b[j] < x;
+		if (i < RB_FROZEN_BLOCK) found = k * RB_FROZEN_BLOCK + i;
+		k = rb_frozen_child(k, i);
+	}
+	return found;
+}
+
+#ifdef RB_FROZEN_AVX2
+__attribute__((target("avx2,popcnt"))) static size_t
+rb_frozen_lower_avx2(const rb_frozen_t *f, int64_t x)
+{
+	__m256i v	  = _mm256_set1_epi64x(x);
+	size_t	found = SIZE_MAX;
+
+	for (size_t k = 0; k < f->nblocks;) {
+		const __m256i *b  = (const __m256i *)(f->keys + k * RB_FROZEN_BLOCK);
+		__m256i		   lo = _mm256_cmpgt_epi64(v, _mm256_load_si256(b));
+		__m256i		   hi = _mm256_cmpgt_epi64(v, _mm256_load_si256(b + 1));
+		unsigned	   m  = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(lo)) |
+					(unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(hi)) << 4;
+		size_t i = (size_t)__builtin_popcount(m);
+		if (i < RB_FROZEN_BLOCK) found = k * RB_FROZEN_BLOCK + i;
+		k = rb_frozen_child(k, i);
+	}
+	return found;
+}
+#endif
+
+/* the avx2 descent when the cpu has it */
+static size_t
+rb_frozen_lower(const rb_frozen_t *f, int64_t x)
+{
+#ifdef RB_FROZEN_AVX2
+	if (f->avx2) return rb_frozen_lower_avx2(f, x);
+#endif
+	return rb_frozen_lower_scalar(f, x);
+}
+
+node_t *
+lower_bound_frozen(const rb_frozen_t *f, void *key)
+{
+	size_t s = rb_frozen_lower(f, rb_frozen_flip(key));
+	return s == SIZE_MAX ? NULL : f->nodes[s];
+}
+
+/* the match is checked against the snapshot's copy of the key, the node is
+ * not touched */
+node_t *
+search_frozen(const rb_frozen_t *f, void *key)
+{
+	int64_t x = rb_frozen_flip(key);
+	size_t	s = rb_frozen_lower(f, x);
+	return s != SIZE_MAX && f->keys[s] == x ? f->nodes[s] : NULL;
+}
+
+size_t
+frozen_count(const rb_frozen_t *f)
+{
+	return f->count;
+}
+
+void
+free_frozen(rb_frozen_t *f)
+{
+	if (f == NULL) return;
+	free(f->keys);
+	free(f->nodes);
+	free(f);
+}
+
+bool
+tree_freeze(rbtree_t *t)
+{
+	rb_frozen_t *f = freeze_tree(t->root);
+	if (f == NULL) return false;
+	free_frozen(t->frozen);
+	t->frozen = f;
+	return true;
+}
@@ -0,0 +1,43 @@
+#ifndef RBTREE_FROZEN_H
+#define RBTREE_FROZEN_H
+
+#include "rbtree.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* frozen snapshots
+ * an immutable copy of a tree laid out for search. the keys, in order, are
+ * packed into blocks of RB_FROZEN_BLOCK keys that fill one cache line each
+ * and form an implicit (RB_FROZEN_BLOCK + 1)-ary search tree, the children
+ * of block k are blocks k * (RB_FROZEN_BLOCK + 1) + 1 + i. a search reads one
+ * line per level, log9(n) lines instead of log2(n) nodes, and ranks the key
+ * within a line with two avx2 compares when the cpu has them (a scalar loop
+ * otherwise). every slot keeps the tree's node for its key, so values and
+ * iteration from a result work as usual.
+ *
+ * a snapshot points into the tree it was taken from and goes stale with the
+ * first insert or delete on that tree. a handle drops its snapshot on every
+ * mutation, its searches fall back to the live tree until the next
+ * tree_freeze. */
+
+#define RB_FROZEN_BLOCK 8 /* keys per block, 64 bytes */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct rb_frozen_t rb_frozen_t;
+
+/* clang-format off */
+rb_frozen_t *freeze_tree(node_t *root); /* snapshot of a tree in two in-order passes, NULL if out of memory */
+node_t *search_frozen(const rb_frozen_t *f, void *key); /* node holding key, NULL if absent */
+node_t *lower_bound_frozen(const rb_frozen_t *f, void *key); /* node with the smallest key >= key, NULL if there is none */
+size_t frozen_count(const rb_frozen_t *f); /* number of keys in the snapshot */
+void free_frozen(rb_frozen_t *f); /* releases a snapshot, the tree is left alone */
+bool tree_freeze(rbtree_t *t); /* snapshots the handle's tree, tree_search uses it until the next mutation. false if out of memory */
+/* clang-format on */
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,337 @@
+#ifndef RBTREE_GEN_H
+#define RBTREE_GEN_H
+
+/* type specialized trees
+ * RB_GENERATE(name, key_type, less) emits a red-black tree whose nodes hold a
+ * key_type inline, ordered by less(a, b) (a function or function-like macro,
+ * true when a sorts before b). the descents call less directly, so with
+ * RB_LESS on an integer key every visited node costs one compare and no
+ * pointer chase to reach the key.
+ *
+ *	RB_GENERATE(u64tree, uint64_t, RB_LESS)
+ *
+ *	u64tree_t t;
+ *	u64tree_init(&t);
+ *	u64tree_insert(&t, 42);
+ *	u64tree_node_t *n = u64tree_search(&t, 42);
+ *	u64tree_clear(&t);
+ *
+ * emits, all static inline:
+ *	name_node_t, name_t	       node with key, parent, left, right, color,
+ *	                           and the tree {root, size}
+ *	name_init(t)
+ *	name_search(t, key)        node holding key or NULL
+ *	name_lower_bound(t, key)   first node not less than key or NULL
+ *	name_first(t), name_next(n), name_prev(n)
+ *	name_insert(t, key)        false if present or out of memory
+ *	name_insert_node(t, n)     links a caller allocated node, returns the
+ *	                           node already holding n->key or NULL
+ *	name_remove(t, n)          unlinks n, does not free it
+ *	name_delete(t, key)        false if absent
+ *	name_clear(t)              frees every node
+ *
+ * nodes come from RB_GEN_MALLOC and go back to RB_GEN_FREE, define both
+ * before including this header to use another allocator. */
+#include "rbtree.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#ifndef RB_GEN_MALLOC
+#define RB_GEN_MALLOC malloc
+#define RB_GEN_FREE	  free
+#endif
+
+/* less for anything with a builtin < */
+#define RB_LESS(a, b) ((a) < (b))
+
+/* clang-format off */
+#define RB_GENERATE(name, key_type, less)                                   \
+typedef struct name##_node {                                                \
+	key_type			key;                                                \
+	struct name##_node *parent;                                             \
+	struct name##_node *left;                                               \
+	struct name##_node *right;                                              \
+	color_t				color;                                              \
+} name##_node_t;                                                            \
+                                                                            \
+typedef struct {                                                            \
+	name##_node_t *root;                                                    \
+	size_t		   size;                                                    \
+} name##_t;                                                                 \
+                                                                            \
+static inline void                                                          \
+name##_init(name##_t *t)                                                    \
+{                                                                           \
+	t->root = NULL;                                                         \
+	t->size = 0;                                                            \
+}                                                                           \
+                                                                            \
+/* first node whose key is not less than key. the descent always runs to a  \
+ * leaf and picks the child with a select on the comparison, so it has no   \
+ * data dependent branch to mispredict */                                   \
+static inline name##_node_t *                                               \
+name##_lower_bound(const name##_t *t, key_type key)                         \
+{                                                                           \
+	name##_node_t *n = t->root, *found = NULL;                              \
+	while (n != NULL) {                                                     \
+		bool right = less(n->key, key);                                     \
+		found	   = right ? found : n;                                     \
+		n		   = right ? n->right : n->left;                            \
+	}                                                                       \
+	return found;                                                           \
+}                                                                           \
+                                                                            \
+static inline name##_node_t *                                               \
+name##_search(const name##_t *t, key_type key)                              \
+{                                                                           \
+	name##_node_t *n = name##_lower_bound(t, key);                          \
+	return n && !less(key, n->key) ? n : NULL;                              \
+}                                                                           \
+                                                                            \
+static inline name##_node_t *                                               \
+name##_first(const name##_t *t)                                             \
+{                                                                           \
+	name##_node_t *n = t->root;                                             \
+	if (n == NULL) return NULL;                                             \
+	while (n->left) n = n->left;                                            \
+	return n;                                                               \
+}                                                                           \
+                                                                            \
+static inline name##_node_t *                                               \
+name##_next(name##_node_t *n)                                               \
+{                                                                           \
+	if (n->right) {                                                         \
+		n = n->right;                                                       \
+		while (n->left) n = n->left;                                        \
+		return n;                                                           \
+	}                                                                       \
+	while (n->parent && n == n->parent->right) n = n->parent;               \
+	return n->parent;                                                       \
+}                                                                           \
+                                                                            \
+static inline name##_node_t *                                               \
+name##_prev(name##_node_t *n)                                               \
+{                                                                           \
+	if (n->left) {                                                          \
+		n = n->left;                                                        \
+		while (n->right) n = n->right;                                      \
+		return n;                                                           \
+	}                                                                       \
+	while (n->parent && n == n->parent->left) n = n->parent;                \
+	return n->parent;                                                       \
+}                                                                           \
+                                                                            \
+/* left moves node->right up into node's place, otherwise node->left */     \
+static inline void                                                          \
+name##_rotate(name##_t *t, name##_node_t *node, int left)                   \
+{                                                                           \
+	name##_node_t *pivot = left ? node->right : node->left;                 \
+                                                                            \
+	if (left) {                                                             \
+		node->right = pivot->left;                                          \
+		if (pivot->left) pivot->left->parent = node;                        \
+		pivot->left = node;                                                 \
+	} else {                                                                \
+		node->left = pivot->right;                                          \
+		if (pivot->right) pivot->right->parent = node;                      \
+		pivot->right = node;                                                \
+	}                                                                       \
+	pivot->parent = node->parent;                                           \
+	if (node->parent == NULL)                                               \
+		t->root = pivot;                                                    \
+	else if (node->parent->left == node)                                    \
+		node->parent->left = pivot;                                         \
+	else                                                                    \
+		node->parent->right = pivot;                                        \
+	node->parent = pivot;                                                   \
+}                                                                           \
+                                                                            \
+static inline void                                                          \
+name##_insert_fixup(name##_t *t, name##_node_t *n)                          \
+{                                                                           \
+	while (n->parent && n->parent->color == RED) {                          \
+		name##_node_t *p	 = n->parent, *g = p->parent;                   \
+		int			   pleft = p == g->left;                                \
+		name##_node_t *aunt	 = pleft ? g->right : g->left;                  \
+                                                                            \
+		if (aunt && aunt->color == RED) {                                   \
+			g->color = RED;                                                 \
+			p->color = aunt->color = BLACK;                                 \
+			n					   = g;                                     \
+			continue;                                                       \
+		}                                                                   \
+		if (n == (pleft ? p->right : p->left)) {                            \
+			name##_rotate(t, p, pleft);                                     \
+			p = n;                                                          \
+		}                                                                   \
+		name##_rotate(t, g, !pleft);                                        \
+		p->color = BLACK;                                                   \
+		g->color = RED;                                                     \
+		break;                                                              \
+	}                                                                       \
+	t->root->color = BLACK;                                                 \
+}                                                                           \
+                                                                            \
+/* links a caller allocated node holding node->key. returns the node that   \
+ * already holds an equal key, or NULL once node is in the tree */          \
+static inline name##_node_t *                                               \
+name##_insert_node(name##_t *t, name##_node_t *node)                        \
+{                                                                           \
+	name##_node_t *parent = NULL, **link = &t->root;                        \
+                                                                            \
+	while (*link) {                                                         \
+		parent = *link;                                                     \
+		if (less(node->key, parent->key))                                   \
+			link = &parent->left;                                           \
+		else if (less(parent->key, node->key))                              \
+			link = &parent->right;                                          \
+		else                                                                \
+			return parent;                                                  \
+	}                                                                       \
+	node->parent = parent;                                                  \
+	node->left = node->right = NULL;                                        \
+	node->color				 = RED;                                         \
+	*link					 = node;                                        \
+	t->size++;                                                              \
+	name##_insert_fixup(t, node);                                           \
+	return NULL;                                                            \
+}                                                                           \
+                                                                            \
+/* false if the key is already in the tree or the node cannot be allocated */ \
+static inline bool                                                          \
+name##_insert(name##_t *t, key_type key)                                    \
+{                                                                           \
+	name##_node_t *n = (name##_node_t *)RB_GEN_MALLOC(sizeof(name##_node_t)); \
+	if (n == NULL) return false;                                            \
+	n->key = key;                                                           \
+	if (name##_insert_node(t, n) == NULL) return true;                      \
+	RB_GEN_FREE(n);                                                         \
+	return false;                                                           \
+}                                                                           \
+                                                                            \
+static inline void                                                          \
+name##_transplant(name##_t *t, name##_node_t *n, name##_node_t *child)      \
+{                                                                           \
+	if (n->parent == NULL)                                                  \
+		t->root = child;                                                    \
+	else if (n == n->parent->left)                                          \
+		n->parent->left = child;                                            \
+	else                                                                    \
+		n->parent->right = child;                                           \
+	if (child) child->parent = n->parent;                                   \
+}                                                                           \
+                                                                            \
+static inline void                                                          \
+name##_remove_fixup(name##_t *t, name##_node_t *x, name##_node_t *xparent)  \
+{                                                                           \
+	while (x != t->root && (x == NULL || x->color == BLACK)) {              \
+		int			   left = x == xparent->left;                           \
+		name##_node_t *w	= left ? xparent->right : xparent->left;        \
+                                                                            \
+		if (w->color == RED) {                                              \
+			w->color	   = BLACK;                                         \
+			xparent->color = RED;                                           \
+			name##_rotate(t, xparent, left);                                \
+			w = left ? xparent->right : xparent->left;                      \
+		}                                                                   \
+                                                                            \
+		name##_node_t *near = left ? w->left : w->right;                    \
+		name##_node_t *far	= left ? w->right : w->left;                    \
+                                                                            \
+		if ((near == NULL || near->color == BLACK) &&                       \
+			(far == NULL || far->color == BLACK)) {                         \
+			w->color = RED;                                                 \
+			x		 = xparent;                                             \
+			xparent	 = x->parent;                                           \
+			continue;                                                       \
+		}                                                                   \
+		if (far == NULL || far->color == BLACK) {                           \
+			near->color = BLACK;                                            \
+			w->color	= RED;                                              \
+			name##_rotate(t, w, !left);                                     \
+			w	= left ? xparent->right : xparent->left;                    \
+			far = left ? w->right : w->left;                                \
+		}                                                                   \
+		w->color	   = xparent->color;                                    \
+		xparent->color = BLACK;                                             \
+		far->color	   = BLACK;                                             \
+		name##_rotate(t, xparent, left);                                    \
+		x = t->root;                                                        \
+	}                                                                       \
+	if (x) x->color = BLACK;                                                \
+}                                                                           \
+                                                                            \
+/* unlinks z without freeing it, the other nodes are relinked, never copied */ \
+static inline void                                                          \
+name##_remove(name##_t *t, name##_node_t *z)                                \
+{                                                                           \
+	name##_node_t *x, *xparent;                                             \
+	color_t		   removed = z->color;                                      \
+                                                                            \
+	if (z->left == NULL || z->right == NULL) {                              \
+		x		= z->left ? z->left : z->right;                             \
+		xparent = z->parent;                                                \
+		name##_transplant(t, z, x);                                         \
+	} else {                                                                \
+		name##_node_t *y = z->right;                                        \
+		while (y->left) y = y->left;                                        \
+                                                                            \
+		removed = y->color;                                                 \
+		x		= y->right;                                                 \
+		if (y->parent == z) {                                               \
+			xparent = y;                                                    \
+		} else {                                                            \
+			xparent = y->parent;                                            \
+			name##_transplant(t, y, y->right);                              \
+			y->right		 = z->right;                                    \
+			y->right->parent = y;                                           \
+		}                                                                   \
+		name##_transplant(t, z, y);                                         \
+		y->left			= z->left;                                          \
+		y->left->parent = y;                                                \
+		y->color		= z->color;                                         \
+	}                                                                       \
+	z->parent = z->left = z->right = NULL;                                  \
+	t->size--;                                                              \
+	if (removed == BLACK) name##_remove_fixup(t, x, xparent);               \
+}                                                                           \
+                                                                            \
+static inline bool                                                          \
+name##_delete(name##_t *t, key_type key)                                    \
+{                                                                           \
+	name##_node_t *n = name##_search(t, key);                               \
+	if (n == NULL) return false;                                            \
+	name##_remove(t, n);                                                    \
+	RB_GEN_FREE(n);                                                         \
+	return true;                                                            \
+}                                                                           \
+                                                                            \
+/* frees every node, bottom up through the parent pointers */               \
+static inline void                                                          \
+name##_clear(name##_t *t)                                                   \
+{                                                                           \
+	name##_node_t *n = t->root;                                             \
+                                                                            \
+	while (n != NULL) {                                                     \
+		if (n->left) {                                                      \
+			n = n->left;                                                    \
+		} else if (n->right) {                                              \
+			n = n->right;                                                   \
+		} else {                                                            \
+			name##_node_t *parent = n->parent;                              \
+			if (parent) {                                                   \
+				if (parent->left == n)                                      \
+					parent->left = NULL;                                    \
+				else                                                        \
+					parent->right = NULL;                                   \
+			}                                                               \
+			RB_GEN_FREE(n);                                                 \
+			n = parent;                                                     \
+		}                                                                   \
+	}                                                                       \
+	name##_init(t);                                                         \
+}
+/* clang-format on */
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef RBTREE_INTERNAL_H
+#define RBTREE_INTERNAL_H
+
+/* node layout, shared by the modules of the library but not part of the
+ * public api */
+#include "rbtree.h"
+#include "rbtree_frozen.h"
+#include "rbtree_trace.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* tree node definition */
+struct node_t {
+	void   *key;	/* key/value */
+	node_t *parent; /* parent*/
+	node_t *left;	/* left subtree */
+	node_t *right;	/* right subtree */
+	color_t color;	/* either red or black, always black for null or tree
+					   root node */
+	bool	pooled; /* lives in a build_tree block, never freed on its own */
+	bool	has_value; /* allocated as an rb_pair_t */
+	bool	multi;	   /* allocated as an rb_multi_t */
+};
+
+/* map mode node, the value sits right after the key's node so a lookup
+ * reads both from the same allocation */
+typedef struct {
+	node_t node;
+	void  *value;
+} rb_pair_t;
+
+/* multiset node: every duplicate of a key is a node of its own and they sit
+ * in insertion order. the last node of each run of equal keys holds the
+ * run's length, so counting a key takes one descent */
+typedef struct {
+	rb_pair_t pair;
+	size_t	  run; /* nodes with this key on the last of them, else 0 */
+} rb_multi_t;
+
+/* kind of a mutation recorded in a delta log */
+typedef enum {
+	RB_OP_INSERT = 1,
+	RB_OP_DELETE
+} rb_op_t;
+
+typedef struct {
+	void   *key;
+	rb_op_t op;
+} rb_delta_entry_t;
+
+/* mutations since the last checkpoint, in the order they happened */
+typedef struct {
+	rb_delta_entry_t *entries;
+	size_t			  len;
+	size_t			  cap;
+	bool			  lost; /* a mutation did not fit, only a base recovers */
+} rb_delta_t;
+
+/* tree handle */
+struct rbtree_t {
+	node_t	   *root;
+	node_t	  **blocks;	 /* node arrays from build_tree, freed with the tree */
+	size_t		nblocks;
+	rb_delta_t	delta; /* mutations since the last checkpoint */
+	bool		track; /* record mutations into delta */
+	bool		use_finger; /* inserts start at finger */
+	node_t	   *finger;		/* node of the last insert, NULL if unknown */
+	node_t	   *first;		/* smallest and largest node, kept in finger mode */
+	node_t	   *last;
+	rb_frozen_t *frozen;	/* search snapshot, dropped by every mutation */
+	bool		compacting; /* compactor is running tree_compact_begin */
+	pthread_t	compactor;
+	node_t	   *compacted; /* its copy and block, read after the join */
+	node_t	   *compacted_block;
+#ifdef RB_STATS
+	rb_stats_t stats;
+#endif
+};
+
+/* instrumentation counters
+ * the handle points rb_stats_current at its counters for the duration of an
+ * operation, so the hot paths can count without taking the handle as an
+ * argument. without RB_STATS every macro compiles to nothing. */
+#ifdef RB_STATS
+extern _Thread_local rb_stats_t *rb_stats_current;
+
+#define RB_STAT_ADD(field, n)                                             \
+	do {                                                                  \
+		if (rb_stats_current) rb_stats_current->field += (n);             \
+	} while (0)
+#define RB_STAT_MAX(field, v)                                             \
+	do {                                                                  \
+		if (rb_stats_current && rb_stats_current->field < (v))            \
+			rb_stats_current->field = (v);                                \
+	} while (0)
+#define RB_STATS_BEGIN(t)                                                 \
+	rb_stats_t *rb_stats_saved = rb_stats_current;                        \
+	rb_stats_current		   = &(t)->stats
+#define RB_STATS_END() (rb_stats_current = rb_stats_saved)
+#else
+#define RB_STAT_ADD(field, n) ((void)0)
+#define RB_STAT_MAX(field, v) ((void)(v))
+#define RB_STATS_BEGIN(t)	  ((void)0)
+#define RB_STATS_END()		  ((void)0)
+#endif
+
+/* software prefetch for the descents: both children of the node at hand are
+ * requested before the comparison picks one, so a mispredicted branch does
+ * not cost a second miss. prefetches never fault, NULL children need no
+ * check, which keeps branch-free descents branch-free. without RB_PREFETCH
+ * it compiles to nothing */
+#ifdef RB_PREFETCH
+#define RB_PREFETCH_CHILDREN(n)                                           \
+	do {                                                                  \
+		__builtin_prefetch((n)->left);                                    \
+		__builtin_prefetch((n)->right);                                   \
+	} while (0)
+#else
+#define RB_PREFETCH_CHILDREN(n) ((void)0)
+#endif
+
+/* latency tracing, see rbtree_trace.h
+ * RB_TRACE_BEGIN opens an operation in the current scope and RB_TRACE_END
+ * records it, on every return path. without RB_TRACE they compile to
+ * nothing. */
+static inline uint64_t
+rb_trace_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#elif defined(__aarch64__)
+	uint64_t v;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(v));
+	return v;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+#ifdef RB_TRACE
+extern _Thread_local uint32_t rb_trace_rotations;
+void rb_trace_record(rb_trace_op_t op, uint64_t start, uint32_t rotations);
+
+#define RB_TRACE_BEGIN()                                                  \
+	uint64_t rb_trace_t0 = rb_trace_now();                                \
+	uint32_t rb_trace_r0 = rb_trace_rotations
+#define RB_TRACE_END(op)                                                  \
+	rb_trace_record((op), rb_trace_t0, rb_trace_rotations - rb_trace_r0)
+#define RB_TRACE_ROTATION() (rb_trace_rotations++)
+#else
+#define RB_TRACE_BEGIN()	((void)0)
+#define RB_TRACE_END(op)	((void)0)
+#define RB_TRACE_ROTATION() ((void)0)
+#endif
+
+#define RB_FNV_OFFSET 0xcbf29ce484222325ULL
+#define RB_FNV_PRIME  0x100000001b3ULL
+
+/* fnv-1a, used as checksum by the file formats */
+static inline uint64_t
+rb_fnv1a(uint64_t h, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= RB_FNV_PRIME;
+	}
+	return h;
+}
+
+#endif
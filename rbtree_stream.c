@@ -0,0 +1,314 @@
+#include "rbtree_stream.h"
+#include "rbtree_internal.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+	int			  fd;
+	size_t		  len;
+	uint64_t	  checksum; /* over the records, not the magic or trailer */
+	bool		  failed;
+	unsigned char buf[RB_STREAM_BUF_SIZE];
+} rb_stream_writer_t;
+
+typedef struct {
+	int			  fd;
+	size_t		  pos, len;
+	uint64_t	  checksum;
+	unsigned char buf[RB_STREAM_BUF_SIZE];
+} rb_stream_reader_t;
+
+static void
+rb_stream_flush(rb_stream_writer_t *w)
+{
+	size_t off = 0;
+
+	while (!w->failed && off < w->len) {
+		ssize_t n = write(w->fd, w->buf + off, w->len - off);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			w->failed = true;
+			break;
+		}
+		off += n;
+	}
+	w->len = 0;
+}
+
+static void
+rb_stream_put(rb_stream_writer_t *w, const void *data, size_t len, bool record)
+{
+	if (record) w->checksum = rb_fnv1a(w->checksum, data, len);
+	if (w->len + len > sizeof(w->buf)) rb_stream_flush(w);
+	memcpy(w->buf + w->len, data, len);
+	w->len += len;
+}
+
+static void
+rb_stream_put_u64(rb_stream_writer_t *w, uint64_t v, bool record)
+{
+	rb_stream_put(w, &v, sizeof(v), record);
+}
+
+/* ends a stream with its terminator, record count and checksum */
+static int
+rb_stream_finish(rb_stream_writer_t *w, const void *end, size_t end_len,
+				 uint64_t count)
+{
+	rb_stream_put(w, end, end_len, false);
+	rb_stream_put_u64(w, count, false);
+	rb_stream_put_u64(w, w->checksum, false);
+	rb_stream_flush(w);
+	return w->failed ? -1 : 0;
+}
+
+/* reads exactly len bytes, false on error or early end of stream */
+static bool
+rb_stream_get(rb_stream_reader_t *r, void *data, size_t len, bool record)
+{
+	unsigned char *out	= data;
+	size_t		   want = len;
+
+	while (want > 0) {
+		if (r->pos == r->len) {
+			ssize_t n = read(r->fd, r->buf, sizeof(r->buf));
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) {
+				if (n == 0) errno = EINVAL;
+				return false;
+			}
+			r->pos = 0;
+			r->len = n;
+		}
+		size_t chunk = r->len - r->pos < want ? r->len - r->pos : want;
+		memcpy(out, r->buf + r->pos, chunk);
+		r->pos += chunk;
+		out += chunk;
+		want -= chunk;
+	}
+	if (record) r->checksum = rb_fnv1a(r->checksum, data, len);
+	return true;
+}
+
+/* checks the magic, and the count and checksum once the terminator was read */
+static bool
+rb_stream_check(rb_stream_reader_t *r, uint64_t count)
+{
+	uint64_t trailer[2];
+
+	if (!rb_stream_get(r, trailer, sizeof(trailer), false)) return false;
+	if (trailer[0] != count || trailer[1] != r->checksum) {
+		errno = EINVAL;
+		return false;
+	}
+	return true;
+}
+
+static bool
+rb_stream_magic(rb_stream_reader_t *r, const char *magic)
+{
+	char buf[8];
+
+	if (!rb_stream_get(r, buf, sizeof(buf), false)) return false;
+	if (memcmp(buf, magic, sizeof(buf)) != 0) {
+		errno = EINVAL;
+		return false;
+	}
+	return true;
+}
+
+int
+stream_tree(node_t *root, int fd)
+{
+	rb_stream_writer_t *w = malloc(sizeof(*w));
+	if (w == NULL) return -1;
+
+	w->fd		= fd;
+	w->len		= 0;
+	w->checksum = RB_FNV_OFFSET;
+	w->failed	= false;
+	rb_stream_put(w, RB_STREAM_BASE_MAGIC, 8, false);
+
+	/* in order through the parent pointers, no stack */
+	node_t	*n	   = first_node(root);
+	uint64_t count = 0;
+	for (; n && !w->failed; n = next_node(n), count++)
+		rb_stream_put_u64(w, (uint64_t)(uintptr_t)n->key, true);
+
+	uint64_t end = 0;
+	int		 ret = rb_stream_finish(w, &end, sizeof(end), count);
+	free(w);
+	return ret;
+}
+
+int
+write_base(rbtree_t *t, int fd)
+{
+	if (stream_tree(t->root, fd) != 0) return -1;
+	t->delta.len  = 0;
+	t->delta.lost = false;
+	t->track	  = true;
+	return 0;
+}
+
+int
+write_delta(rbtree_t *t, int fd)
+{
+	/* a delta with a hole would restore the wrong tree */
+	if (t->delta.lost) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	rb_stream_writer_t *w = malloc(sizeof(*w));
+	if (w == NULL) return -1;
+
+	w->fd		= fd;
+	w->len		= 0;
+	w->checksum = RB_FNV_OFFSET;
+	w->failed	= false;
+	rb_stream_put(w, RB_STREAM_DELTA_MAGIC, 8, false);
+
+	for (size_t i = 0; i < t->delta.len && !w->failed; i++) {
+		uint8_t op = t->delta.entries[i].op;
+		rb_stream_put(w, &op, sizeof(op), true);
+		rb_stream_put_u64(w, (uint64_t)(uintptr_t)t->delta.entries[i].key,
+						  true);
+	}
+
+	uint8_t end = 0;
+	int		ret = rb_stream_finish(w, &end, sizeof(end), t->delta.len);
+	free(w);
+	if (ret == 0) t->delta.len = 0;
+	return ret;
+}
+
+/* reads the sorted keys of a base into a growing array */
+static void **
+rb_stream_read_base(rb_stream_reader_t *r, size_t *count)
+{
+	size_t	 cap  = 1024, n = 0;
+	void   **keys = malloc(cap * sizeof(void *));
+	uint64_t key, prev = 0;
+
+	if (keys == NULL || !rb_stream_magic(r, RB_STREAM_BASE_MAGIC)) goto fail;
+
+	for (;;) {
+		if (!rb_stream_get(r, &key, sizeof(key), false)) goto fail;
+		if (key == 0) break;
+		if (key <= prev) {
+			errno = EINVAL;
+			goto fail;
+		}
+		r->checksum = rb_fnv1a(r->checksum, &key, sizeof(key));
+		if (n == cap) {
+			void **grown = realloc(keys, cap * 2 * sizeof(void *));
+			if (grown == NULL) goto fail;
+			keys = grown;
+			cap *= 2;
+		}
+		keys[n++] = (void *)(uintptr_t)key;
+		prev	  = key;
+	}
+	if (!rb_stream_check(r, n)) goto fail;
+
+	*count = n;
+	return keys;
+
+fail:
+	free(keys);
+	return NULL;
+}
+
+/* a delta is read and checked as a whole before anything is replayed */
+static bool
+rb_stream_replay_delta(rbtree_t *t, rb_stream_reader_t *r)
+{
+	rb_delta_t d = {NULL, 0, 0, false};
+	uint8_t	   op;
+	uint64_t   key;
+
+	if (!rb_stream_magic(r, RB_STREAM_DELTA_MAGIC)) return false;
+
+	for (;;) {
+		if (!rb_stream_get(r, &op, sizeof(op), false)) goto fail;
+		if (op == 0) break;
+		r->checksum = rb_fnv1a(r->checksum, &op, sizeof(op));
+		if ((op != RB_OP_INSERT && op != RB_OP_DELETE) ||
+			!rb_stream_get(r, &key, sizeof(key), true)) {
+			errno = EINVAL;
+			goto fail;
+		}
+		if (d.len == d.cap) {
+			size_t			  cap = d.cap ? d.cap * 2 : 1024;
+			rb_delta_entry_t *e	  = realloc(d.entries, cap * sizeof(*e));
+			if (e == NULL) goto fail;
+			d.entries = e;
+			d.cap	  = cap;
+		}
+		d.entries[d.len].op	 = op;
+		d.entries[d.len].key = (void *)(uintptr_t)key;
+		d.len++;
+	}
+	if (!rb_stream_check(r, d.len)) goto fail;
+
+	for (size_t i = 0; i < d.len; i++) {
+		if (d.entries[i].op == RB_OP_INSERT)
+			tree_insert(t, d.entries[i].key);
+		else
+			tree_delete(t, d.entries[i].key);
+	}
+	free(d.entries);
+	return true;
+
+fail:
+	free(d.entries);
+	return false;
+}
+
+rbtree_t *
+load_checkpoint(int base_fd, const int *delta_fds, size_t ndeltas,
+				unsigned nthreads)
+{
+	rb_stream_reader_t *r = malloc(sizeof(*r));
+	if (r == NULL) return NULL;
+
+	r->fd		= base_fd;
+	r->pos		= r->len = 0;
+	r->checksum = RB_FNV_OFFSET;
+
+	size_t	count;
+	void  **keys = rb_stream_read_base(r, &count);
+	if (keys == NULL) {
+		free(r);
+		return NULL;
+	}
+
+	node_t	 *block;
+	node_t	 *root = build_tree(keys, count, nthreads, &block);
+	rbtree_t *t	   = create_tree(root, block);
+	free(keys);
+	if (t == NULL || (count > 0 && root == NULL)) {
+		if (t == NULL) free(block);
+		destroy_tree(t);
+		free(r);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < ndeltas; i++) {
+		r->fd		= delta_fds[i];
+		r->pos		= r->len = 0;
+		r->checksum = RB_FNV_OFFSET;
+		if (!rb_stream_replay_delta(t, r)) {
+			destroy_tree(t);
+			free(r);
+			return NULL;
+		}
+	}
+	free(r);
+
+	t->track = true;
+	return t;
+}
@@ -0,0 +1,39 @@
+#ifndef RBTREE_STREAM_H
+#define RBTREE_STREAM_H
+
+#include "rbtree.h"
+
+/* streaming snapshots and incremental checkpoints
+ * a base is the whole key set written in order, a delta holds the inserts and
+ * deletes done through the handle since the previous base or delta. both go
+ * to any file descriptor (file, pipe, socket) through a fixed size buffer, so
+ * the memory used does not depend on the size of the tree. the state of a tree
+ * is restored by loading its last base and replaying the deltas written after
+ * it, in order.
+ *
+ * keys are written as 64 bit values, like the tree file format.
+ *
+ * base:  "RBBASE\0\1", key... (u64, ascending), 0 (u64), count (u64),
+ *        checksum (u64, fnv-1a over the keys)
+ * delta: "RBDELT\0\1", {op (u8), key (u64)}..., 0 (u8), count (u64),
+ *        checksum (u64, fnv-1a over the records) */
+
+#define RB_STREAM_BASE_MAGIC  "RBBASE\0\1"
+#define RB_STREAM_DELTA_MAGIC "RBDELT\0\1"
+#define RB_STREAM_BUF_SIZE	  (64 * 1024)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* clang-format off */
+int stream_tree(node_t *root, int fd); /* writes a base of the tree in one in-order pass, returns 0 or -1 with errno set */
+int write_base(rbtree_t *t, int fd); /* stream_tree on a handle, then starts recording changes for write_delta */
+int write_delta(rbtree_t *t, int fd); /* writes the changes since the last base or delta, the log is reset on success. fails with ENOMEM once a change could not be recorded, until the next write_base */
+rbtree_t *load_checkpoint(int base_fd, const int *delta_fds, size_t ndeltas, unsigned nthreads); /* rebuilds a tree from a base and its deltas, change recording is on */
+/* clang-format on */
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,190 @@
+#include "rbtree_trace.h"
+#include "rbtree_internal.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RB_TRACE_MASK (RB_TRACE_RING_SIZE - 1)
+
+_Static_assert((RB_TRACE_RING_SIZE & RB_TRACE_MASK) == 0,
+			   "RB_TRACE_RING_SIZE must be a power of two");
+
+/* one ring per thread. rings are never freed, a thread that exits gives its
+ * ring back (owned = false) with the events still in it, and the next new
+ * thread takes it over. */
+typedef struct rb_trace_ring {
+	_Atomic uint64_t	  head;	 /* events ever written, only the owner stores */
+	atomic_bool			  owned; /* a live thread writes into the ring */
+	uint16_t			  id;
+	struct rb_trace_ring *next;
+	rb_trace_event_t	  events[RB_TRACE_RING_SIZE];
+} rb_trace_ring_t;
+
+/* every ring ever made, pushed at the front and never unlinked */
+static _Atomic(rb_trace_ring_t *) rb_trace_rings;
+static atomic_uint				  rb_trace_nrings;
+
+#ifdef RB_TRACE
+_Thread_local uint32_t rb_trace_rotations;
+
+static _Thread_local rb_trace_ring_t *rb_trace_ring;
+static pthread_key_t				  rb_trace_key;
+static pthread_once_t				  rb_trace_once = PTHREAD_ONCE_INIT;
+
+static void
+rb_trace_release(void *ring)
+{
+	atomic_store_explicit(&((rb_trace_ring_t *)ring)->owned, false,
+						  memory_order_release);
+}
+
+static void
+rb_trace_init(void)
+{
+	pthread_key_create(&rb_trace_key, rb_trace_release);
+}
+
+/* ring of the calling thread, a released ring is reused before a new one is
+ * made */
+static rb_trace_ring_t *
+rb_trace_attach(void)
+{
+	rb_trace_ring_t *r;
+
+	pthread_once(&rb_trace_once, rb_trace_init);
+	for (r = atomic_load(&rb_trace_rings); r; r = r->next) {
+		bool expected = false;
+		if (atomic_compare_exchange_strong(&r->owned, &expected, true)) break;
+	}
+	if (r == NULL) {
+		r = calloc(1, sizeof(*r));
+		if (r == NULL) return NULL;
+		atomic_init(&r->owned, true);
+		r->id	= (uint16_t)atomic_fetch_add(&rb_trace_nrings, 1);
+		r->next = atomic_load(&rb_trace_rings);
+		while (!atomic_compare_exchange_weak(&rb_trace_rings, &r->next, r));
+	}
+	pthread_setspecific(rb_trace_key, r);
+	return rb_trace_ring = r;
+}
+
+void
+rb_trace_record(rb_trace_op_t op, uint64_t start, uint32_t rotations)
+{
+	uint64_t		 end = rb_trace_now();
+	rb_trace_ring_t *r	 = rb_trace_ring;
+
+	if (r == NULL && (r = rb_trace_attach()) == NULL) return;
+
+	uint64_t		  h = atomic_load_explicit(&r->head, memory_order_relaxed);
+	rb_trace_event_t *e = &r->events[h & RB_TRACE_MASK];
+
+	e->start	 = start;
+	e->end		 = end;
+	e->rotations = rotations;
+	e->thread	 = r->id;
+	e->op		 = (uint8_t)op;
+	atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+#endif
+
+size_t
+trace_collect(rb_trace_event_t *out, size_t max)
+{
+	size_t n = 0;
+
+	for (rb_trace_ring_t *r = atomic_load(&rb_trace_rings); r && n < max;
+		 r					= r->next) {
+		uint64_t h	 = atomic_load_explicit(&r->head, memory_order_acquire);
+		uint64_t lo	 = h > RB_TRACE_RING_SIZE ? h - RB_TRACE_RING_SIZE : 0;
+		size_t	 got = 0;
+
+		if (h - lo > max - n) lo = h - (max - n);
+		for (uint64_t i = lo; i < h; i++)
+			out[n + got++] = r->events[i & RB_TRACE_MASK];
+
+		/* the owner may have lapped the copy, drop what it overwrote and the
+		 * slot of event h2, which it may be writing right now */
+		uint64_t h2	  = atomic_load_explicit(&r->head, memory_order_acquire);
+		uint64_t keep = h2 >= RB_TRACE_RING_SIZE ? h2 - RB_TRACE_RING_SIZE + 1
+												 : 0;
+		if (keep > lo) {
+			size_t lost = keep - lo < got ? (size_t)(keep - lo) : got;
+			memmove(out + n, out + n + lost,
+					(got - lost) * sizeof(rb_trace_event_t));
+			got -= lost;
+		}
+		n += got;
+	}
+	return n;
+}
+
+void
+trace_reset(void)
+{
+	/* a reset while another thread records may keep its last event */
+	for (rb_trace_ring_t *r = atomic_load(&rb_trace_rings); r; r = r->next)
+		atomic_store_explicit(&r->head, 0, memory_order_release);
+}
+
+static double		  rb_trace_rate;
+static pthread_once_t rb_trace_rate_once = PTHREAD_ONCE_INIT;
+
+static void
+rb_trace_calibrate(void)
+{
+	struct timespec a, b, pause = {0, 20000000};
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	uint64_t t0 = rb_trace_now();
+	nanosleep(&pause, NULL);
+	uint64_t t1 = rb_trace_now();
+	clock_gettime(CLOCK_MONOTONIC, &b);
+
+	double ns = (b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec);
+	rb_trace_rate = (double)(t1 - t0) / ns;
+}
+
+double
+trace_ticks_per_ns(void)
+{
+	pthread_once(&rb_trace_rate_once, rb_trace_calibrate);
+	return rb_trace_rate;
+}
+
+static int
+rb_trace_write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		p += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+int
+write_trace(int fd)
+{
+	size_t			  max = (size_t)atomic_load(&rb_trace_nrings) *
+					 RB_TRACE_RING_SIZE;
+	rb_trace_event_t *ev  = malloc((max ? max : 1) * sizeof(*ev));
+	rb_trace_header_t hdr;
+	int				  rc;
+
+	if (ev == NULL) return -1;
+	hdr.count		 = trace_collect(ev, max);
+	hdr.ticks_per_ns = trace_ticks_per_ns();
+	rc = rb_trace_write_all(fd, RB_TRACE_MAGIC, 8) ||
+		 rb_trace_write_all(fd, &hdr, sizeof(hdr)) ||
+		 rb_trace_write_all(fd, ev, hdr.count * sizeof(*ev));
+	free(ev);
+	return rc ? -1 : 0;
+}
@@ -0,0 +1,55 @@
+#ifndef RBTREE_TRACE_H
+#define RBTREE_TRACE_H
+
+#include "rbtree.h"
+
+/* latency tracing
+ * with RB_TRACE defined insert_node, delete_node and search read the cycle
+ * counter (rdtsc, cntvct on arm64, the monotonic clock elsewhere) on entry and
+ * exit and append an event to a ring owned by the calling thread, together
+ * with the number of rotations the call did. the rings are written without
+ * locks or atomics beyond a release store of the head, a ring keeps the last
+ * RB_TRACE_RING_SIZE events of its thread. without RB_TRACE nothing is
+ * recorded and trace_collect finds no events.
+ *
+ * file:  "RBTRACE\1", rb_trace_header_t, event... */
+
+#define RB_TRACE_MAGIC	   "RBTRACE\1"
+#define RB_TRACE_RING_SIZE 65536 /* events per thread, power of two */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	RB_TRACE_INSERT = 1,
+	RB_TRACE_DELETE,
+	RB_TRACE_SEARCH
+} rb_trace_op_t;
+
+typedef struct {
+	uint64_t start;		/* ticks at entry */
+	uint64_t end;		/* ticks at exit */
+	uint32_t rotations; /* rotations done by the call */
+	uint16_t thread;	/* ring the event came from */
+	uint8_t	 op;		/* rb_trace_op_t */
+	uint8_t	 pad;
+} rb_trace_event_t;
+
+/* follows the magic of a trace file */
+typedef struct {
+	uint64_t count; /* events after the header */
+	double	 ticks_per_ns;
+} rb_trace_header_t;
+
+/* clang-format off */
+size_t trace_collect(rb_trace_event_t *out, size_t max); /* copies the events of every ring into out, oldest first per ring, returns the count */
+void trace_reset(void); /* drops all recorded events */
+double trace_ticks_per_ns(void); /* tick rate, measured once against the monotonic clock */
+int write_trace(int fd); /* writes every recorded event, 0 or -1 */
+/* clang-format on */
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,307 @@
+#include "rbtree_wal.h"
+#include "rbtree_internal.h"
+#include "rbtree_stream.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+	uint64_t key;
+	uint32_t op;
+	uint32_t check;
+} rb_wal_record_t;
+
+/* records appended but not yet written */
+typedef struct {
+	rb_wal_record_t *records;
+	size_t			 len;
+	size_t			 cap;
+} rb_wal_buf_t;
+
+struct rb_wal_t {
+	rbtree_t	   *tree;
+	int				fd;
+	pthread_mutex_t lock; /* tree, pending and everything below */
+	pthread_cond_t	synced;
+	rb_wal_buf_t	pending;
+	rb_wal_buf_t	spare;	  /* swapped with pending by the syncing thread */
+	uint64_t		appended; /* sequence number of the last appended record */
+	uint64_t		durable;  /* records up to here are on stable storage */
+	bool			syncing;  /* a thread is writing a group */
+	int				error;	  /* errno of a failed write, sticky */
+};
+
+/* replay entry, seq keeps the log order among records of the same key */
+typedef struct {
+	uint64_t key;
+	uint64_t seq;
+	uint32_t op;
+} rb_wal_replay_t;
+
+static uint32_t
+rb_wal_check(uint64_t key, uint32_t op)
+{
+	uint64_t h = rb_fnv1a(RB_FNV_OFFSET, &key, sizeof(key));
+	return (uint32_t)rb_fnv1a(h, &op, sizeof(op));
+}
+
+static bool
+rb_wal_write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+static int
+rb_wal_replay_cmp(const void *a, const void *b)
+{
+	const rb_wal_replay_t *x = a, *y = b;
+	if (x->key != y->key) return x->key < y->key ? -1 : 1;
+	return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/* reads every valid record, cuts a torn tail off and applies the final state
+ * of each key with tree_insert_bulk and tree_delete_bulk */
+static bool
+rb_wal_replay(rb_wal_t *w, off_t size, unsigned nthreads)
+{
+	size_t			 n		 = (size - 8) / sizeof(rb_wal_record_t);
+	rb_wal_record_t *records = malloc(n * sizeof(*records) + 1);
+	rb_wal_replay_t *replay	 = malloc(n * sizeof(*replay) + 1);
+	void		   **ins	 = malloc(n * sizeof(void *) + 1);
+	void		   **del	 = malloc(n * sizeof(void *) + 1);
+	size_t			 valid = 0, nins = 0, ndel = 0;
+	bool			 ok = false;
+
+	if (!records || !replay || !ins || !del) goto out;
+	if (pread(w->fd, records, n * sizeof(*records), 8) !=
+		(ssize_t)(n * sizeof(*records)))
+		goto out;
+
+	for (; valid < n; valid++) {
+		rb_wal_record_t *r = &records[valid];
+		if ((r->op != RB_OP_INSERT && r->op != RB_OP_DELETE) ||
+			r->check != rb_wal_check(r->key, r->op))
+			break;
+		replay[valid].key = r->key;
+		replay[valid].seq = valid;
+		replay[valid].op  = r->op;
+	}
+	if (ftruncate(w->fd, 8 + valid * sizeof(rb_wal_record_t)) != 0) goto out;
+
+	/* the last record of a key decides whether it is in the tree */
+	qsort(replay, valid, sizeof(*replay), rb_wal_replay_cmp);
+	for (size_t i = 0; i < valid; i++) {
+		if (i + 1 < valid && replay[i + 1].key == replay[i].key) continue;
+		if (replay[i].op == RB_OP_INSERT)
+			ins[nins++] = (void *)(uintptr_t)replay[i].key;
+		else
+			del[ndel++] = (void *)(uintptr_t)replay[i].key;
+	}
+	ok = tree_insert_bulk(w->tree, ins, nins, nthreads) &&
+		 tree_delete_bulk(w->tree, del, ndel, nthreads);
+
+out:
+	free(records);
+	free(replay);
+	free(ins);
+	free(del);
+	return ok;
+}
+
+rb_wal_t *
+attach_wal(rbtree_t *t, const char *path, unsigned nthreads)
+{
+	rb_wal_t *w = calloc(1, sizeof(*w));
+	if (w == NULL) return NULL;
+
+	w->tree = t;
+	w->fd	= open(path, O_RDWR | O_CREAT, 0644);
+	if (w->fd < 0) {
+		free(w);
+		return NULL;
+	}
+
+	struct stat st;
+	char		magic[8];
+	bool		ok = fstat(w->fd, &st) == 0;
+
+	if (ok && st.st_size < 8) {
+		/* new log, or one that died before its header made it */
+		ok = ftruncate(w->fd, 0) == 0 &&
+			 rb_wal_write_all(w->fd, RB_WAL_MAGIC, 8) && fsync(w->fd) == 0;
+	} else if (ok) {
+		ok = pread(w->fd, magic, 8, 0) == 8 &&
+			 memcmp(magic, RB_WAL_MAGIC, 8) == 0;
+		if (!ok) errno = EINVAL;
+		ok = ok && rb_wal_replay(w, st.st_size, nthreads);
+	}
+	ok = ok && lseek(w->fd, 0, SEEK_END) >= 0;
+
+	if (!ok) {
+		int saved = errno;
+		close(w->fd);
+		free(w);
+		errno = saved;
+		return NULL;
+	}
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->synced, NULL);
+	return w;
+}
+
+/* waits until record seq is durable, writing and syncing the pending group
+ * when no other thread is. called with the lock held */
+static int
+rb_wal_commit(rb_wal_t *w, uint64_t seq)
+{
+	while (w->durable < seq && w->error == 0) {
+		if (w->syncing) {
+			pthread_cond_wait(&w->synced, &w->lock);
+			continue;
+		}
+
+		/* take the whole pending group, later callers fill the spare */
+		rb_wal_buf_t group = w->pending;
+		uint64_t	 upto  = w->appended;
+		w->pending		   = w->spare;
+		w->pending.len	   = 0;
+		w->syncing		   = true;
+		pthread_mutex_unlock(&w->lock);
+
+		bool ok = rb_wal_write_all(w->fd, group.records,
+								   group.len * sizeof(rb_wal_record_t)) &&
+				  fdatasync(w->fd) == 0;
+		int saved = errno;
+
+		pthread_mutex_lock(&w->lock);
+		group.len = 0;
+		w->spare  = group;
+		w->syncing = false;
+		if (ok)
+			w->durable = upto;
+		else
+			w->error = saved ? saved : EIO;
+		pthread_cond_broadcast(&w->synced);
+	}
+
+	if (w->error) {
+		errno = w->error;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+rb_wal_apply(rb_wal_t *w, void *key, rb_op_t op)
+{
+	pthread_mutex_lock(&w->lock);
+	if (w->error) {
+		errno = w->error;
+		pthread_mutex_unlock(&w->lock);
+		return -1;
+	}
+
+	/* room for the record before the tree changes, a change is never left
+	 * without its record */
+	rb_wal_buf_t *b = &w->pending;
+	if (b->len == b->cap) {
+		size_t			 cap = b->cap ? b->cap * 2 : 256;
+		rb_wal_record_t *r	 = realloc(b->records, cap * sizeof(*r));
+		if (r == NULL) {
+			pthread_mutex_unlock(&w->lock);
+			errno = ENOMEM;
+			return -1;
+		}
+		b->records = r;
+		b->cap	   = cap;
+	}
+
+	bool changed = op == RB_OP_INSERT ? tree_insert(w->tree, key)
+									  : tree_delete(w->tree, key);
+	if (changed) {
+		rb_wal_record_t *r = &b->records[b->len++];
+		r->key			   = (uint64_t)(uintptr_t)key;
+		r->op			   = op;
+		r->check		   = rb_wal_check(r->key, r->op);
+		w->appended++;
+	}
+
+	/* a no-op still waits: it may observe a change that is not durable yet */
+	int ret = rb_wal_commit(w, w->appended);
+	pthread_mutex_unlock(&w->lock);
+	return ret < 0 ? -1 : changed;
+}
+
+int
+wal_insert(rb_wal_t *w, void *key)
+{
+	return rb_wal_apply(w, key, RB_OP_INSERT);
+}
+
+int
+wal_delete(rb_wal_t *w, void *key)
+{
+	return rb_wal_apply(w, key, RB_OP_DELETE);
+}
+
+int
+reset_wal(rb_wal_t *w, int fd)
+{
+	pthread_mutex_lock(&w->lock);
+	while (w->syncing) pthread_cond_wait(&w->synced, &w->lock);
+
+	/* the base and the cut happen under the lock, so no record lands between
+	 * them and gets lost with the log */
+	if (w->error) {
+		errno = w->error;
+		pthread_mutex_unlock(&w->lock);
+		return -1;
+	}
+	if (write_base(w->tree, fd) != 0 || fsync(fd) != 0) {
+		pthread_mutex_unlock(&w->lock);
+		return -1;
+	}
+
+	/* pending records are part of the saved base, nobody needs to sync them */
+	w->pending.len = 0;
+	w->durable	   = w->appended;
+	pthread_cond_broadcast(&w->synced);
+
+	int ret = 0;
+	if (ftruncate(w->fd, 8) != 0 || lseek(w->fd, 0, SEEK_END) < 0 ||
+		fsync(w->fd) != 0)
+		ret = -1;
+	pthread_mutex_unlock(&w->lock);
+	return ret;
+}
+
+void
+detach_wal(rb_wal_t *w)
+{
+	if (w == NULL) return;
+
+	pthread_mutex_lock(&w->lock);
+	rb_wal_commit(w, w->appended);
+	pthread_mutex_unlock(&w->lock);
+
+	close(w->fd);
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->synced);
+	free(w->pending.records);
+	free(w->spare.records);
+	free(w);
+}
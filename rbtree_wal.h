@@ -0,0 +1,41 @@
+#ifndef RBTREE_WAL_H
+#define RBTREE_WAL_H
+
+#include "rbtree.h"
+
+/* write-ahead log
+ * every insert or delete done through the log is appended as a fixed size
+ * record before the call returns, and the call only returns once the record
+ * is on stable storage. callers that arrive while a sync is in flight queue
+ * their records behind it, and the next caller to sync writes and syncs the
+ * whole queue at once (group commit), so n concurrent writers cost about one
+ * fsync instead of n.
+ *
+ * the log serializes all mutations of the tree it is attached to, the tree
+ * must not be changed behind its back while it is attached.
+ *
+ * file:   "RBWAL\0\0\1", record...
+ * record: key (u64), op (u32), check (u32, low bits of fnv-1a over key and
+ *         op). a torn or corrupt record ends the log, it is cut off on
+ *         replay. */
+
+#define RB_WAL_MAGIC "RBWAL\0\0\1"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct rb_wal_t rb_wal_t;
+
+/* clang-format off */
+rb_wal_t *attach_wal(rbtree_t *t, const char *path, unsigned nthreads); /* opens or creates a log, replays it into t through the bulk path, then logs every change */
+int wal_insert(rb_wal_t *w, void *key); /* durable tree_insert, 1 if inserted, 0 if the key was there, -1 on i/o error or out of memory */
+int wal_delete(rb_wal_t *w, void *key); /* durable tree_delete, 1 if deleted, 0 if the key was not there, -1 on i/o error or out of memory */
+int reset_wal(rb_wal_t *w, int fd); /* write_base of the tree to fd, synced, then empties the log, all under the log lock. 0 or -1 */
+void detach_wal(rb_wal_t *w); /* closes the log, the tree stays as it is */
+/* clang-format on */
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,46 @@
+#!/bin/sh
+# prints the ns/op change of every rb_bench row between two --json runs
+#
+# usage: bench_diff.sh before.json after.json
+set -eu
+
+if [ $# -ne 2 ]; then
+	echo "usage: $0 before.json after.json" >&2
+	exit 2
+fi
+
+# rb_bench writes one result object per line
+awk '
+function field(line, name,    s) {
+	if (!match(line, "\"" name "\": \"?[^,\"}]*"))
+		return ""
+	s = substr(line, RSTART, RLENGTH)
+	sub(/^"[^"]*": "?/, "", s)
+	return s
+}
+function key(line) {
+	return sprintf("%-7s %-5s %-7s %10s", field(line, "op"), field(line, "dist"),
+		field(line, "alloc"), field(line, "n"))
+}
+!/"op"/ { next }
+NR == FNR { before[key($0)] = field($0, "ns_per_op"); next }
+{
+	k = key($0)
+	if (!(k in before))
+		next
+	b = before[k]
+	a = field($0, "ns_per_op")
+	if (!header) {
+		printf "%-7s %-5s %-7s %10s %10s %10s %8s\n", "op", "dist", "alloc",
+			"n", "before", "after", "delta"
+		header = 1
+	}
+	printf "%s %10.1f %10.1f %+7.1f%%\n", k, b, a, (b > 0 ? (a - b) * 100 / b : 0)
+	sum += b > 0 ? (a - b) / b : 0
+	rows++
+}
+END {
+	if (rows)
+		printf "mean delta over %d rows: %+.1f%%\n", rows, sum * 100 / rows
+}
+' "$1" "$2"
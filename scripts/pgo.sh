@@ -0,0 +1,52 @@
+#!/bin/sh
+# profile guided optimization workflow
+#
+# 1. builds a plain release (-O3 + LTO) and records its benchmark numbers
+# 2. builds an instrumented release and runs the benchmark suite on it as
+#    training workload
+# 3. rebuilds the same tree with the recorded profile and benchmarks it again
+# 4. prints the per operation delta between 1 and 3
+#
+# training and evaluation use different seeds, so the profile is not scored on
+# the exact key streams it was trained on.
+#
+# usage: scripts/pgo.sh [build-dir] [rb_bench args...]
+# 	build-dir defaults to build/pgo, extra args are passed to every rb_bench
+# 	run, e.g. --sizes=1e5,1e6 --ops=insert,search
+set -eu
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+out=${1:-"$src/build/pgo"}
+[ $# -gt 0 ] && shift
+mkdir -p "$out"
+out=$(cd "$out" && pwd)
+profiles="$out/profiles"
+jobs=$(nproc 2>/dev/null || echo 2)
+
+configure() {
+	cmake -S "$src" -B "$1" -DCMAKE_BUILD_TYPE=Release -DRB_LTO=ON \
+		-DRB_PGO_DIR="$profiles" "$2" >/dev/null
+	cmake --build "$1" -j "$jobs" --target rb_bench >/dev/null
+}
+
+echo "== baseline"
+configure "$out/base" -DRB_PGO=
+"$out/base/rb_bench" --seed=2 --json "$@" >"$out/before.json"
+
+# generate and use must share a build dir, gcc keys profiles by object path
+echo "== training"
+rm -rf "$profiles"
+configure "$out/opt" -DRB_PGO=generate
+"$out/opt/rb_bench" --seed=1 "$@" >/dev/null
+
+if ls "$profiles"/*.profraw >/dev/null 2>&1; then
+	# clang writes raw profiles that have to be merged first
+	llvm-profdata merge -o "$profiles/default.profdata" "$profiles"/*.profraw
+fi
+
+echo "== optimized"
+configure "$out/opt" -DRB_PGO=use
+"$out/opt/rb_bench" --seed=2 --json "$@" >"$out/after.json"
+
+"$src/scripts/bench_diff.sh" "$out/before.json" "$out/after.json" |
+	tee "$out/delta.txt"
@@ -0,0 +1,46 @@
+#!/bin/sh
+# RB_PREFETCH against a plain release on trees that do not fit in the last
+# level cache, where every level of a descent is a miss
+#
+# 1. builds a plain release and an RB_PREFETCH release (-O3 + LTO)
+# 2. runs rb_bench on both with the same seed
+# 3. prints the per operation delta
+#
+# the default size puts four times the last level cache worth of nodes in
+# the tree (a malloc'd node takes about 64 bytes), 1e7 when the cache size is
+# unknown.
+#
+# usage: scripts/prefetch.sh [build-dir] [rb_bench args...]
+# 	build-dir defaults to build/prefetch, extra args replace the default
+# 	--sizes=N --dists=rand --ops=insert,search,delete
+set -eu
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+out=${1:-"$src/build/prefetch"}
+[ $# -gt 0 ] && shift
+mkdir -p "$out"
+out=$(cd "$out" && pwd)
+jobs=$(nproc 2>/dev/null || echo 2)
+
+if [ $# -eq 0 ]; then
+	llc=$(getconf LEVEL3_CACHE_SIZE 2>/dev/null || echo 0)
+	[ "${llc:-0}" -gt 0 ] 2>/dev/null || llc=$((10000000 * 64 / 4))
+	set -- --sizes=$((llc * 4 / 64)) --dists=rand --ops=insert,search,delete
+fi
+
+configure() {
+	cmake -S "$src" -B "$1" -DCMAKE_BUILD_TYPE=Release -DRB_LTO=ON "$2" \
+		>/dev/null
+	cmake --build "$1" -j "$jobs" --target rb_bench >/dev/null
+}
+
+echo "== baseline"
+configure "$out/base" -DRB_PREFETCH=OFF
+"$out/base/rb_bench" --seed=2 --json "$@" >"$out/before.json"
+
+echo "== prefetch"
+configure "$out/opt" -DRB_PREFETCH=ON
+"$out/opt/rb_bench" --seed=2 --json "$@" >"$out/after.json"
+
+"$src/scripts/bench_diff.sh" "$out/before.json" "$out/after.json" |
+	tee "$out/delta.txt"